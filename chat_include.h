@@ -17,10 +17,12 @@
 #define MAX_VSSETS 10
 #define MAX_MEMBERS 100
 #define MAX_PARTICIPANTS 100
-#define MAX_CHATROOMS 100
 #define RECREATE_FILES_IN_STARTUP 0
+#define RECOVERY_THREADS 0				// threads parsing chatroom and log files in startup. 0 = one per cpu, 1 = sequential
+#define DISK_WRITER_THREAD 1			// 1 = log/archive I/O runs on a dedicated thread, 0 = inline in the event handlers
 #define NUM_SERVERS 5
 #define MAX_HISTORY_MESSAGES 100
+#define CLIENT_UPDATE_MESSAGES 25			// most recent messages of the chatroom sent in a client update
 
 #define int32u unsigned int
 
@@ -38,9 +40,21 @@ enum MessageType
 	TYPE_MEMBERSHIP_STATUS = 'v',
 	TYPE_CLIENT_UPDATE = 'i',
 	TYPE_MEMBERSHIP_STATUS_RESPONSE = 'm',
-	TYPE_SERVER_UPDATE = 's',
 	TYPE_ANTY_ENTROPY = 'e',
-	TYPE_PARTICIPANT_UPDATE = 'p'
+	TYPE_PARTICIPANT_UPDATE = 'p',
+	TYPE_CLIENT_DELTA = 'd',
+	TYPE_RESYNC = 'y',
+	TYPE_SERVER_UPDATE_BATCH = 'b',		// log records of any servers in one multicast
+	TYPE_RESEND_CHUNK = 'k'				// records of one log resent to the servers missing them
+};
+
+// changes carried by a TYPE_CLIENT_DELTA: version, number of changes, then each change as its type and fields
+enum DeltaType
+{
+	DELTA_MESSAGE = 'a',				// a message was appended
+	DELTA_LIKES = 'l',					// the number of likes of a message changed
+	DELTA_PARTICIPANT_JOINED = 'j',
+	DELTA_PARTICIPANT_LEFT = 'x'
 };
 
 enum State
@@ -61,7 +75,8 @@ static int log_level;
 typedef struct {
 	u_int32_t lamportCounter;
 	char eventType;
-	char payload[100];
+	u_int32_t payload_length;
+	char payload[112];			// the fields of the event, written with the wire codec (see fileService.h)
 	char additionalInfo[20];
 	char chatroom[20];
 
@@ -9,6 +9,7 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "chat_include.h"
+#include "wireCodec.h"
 
 ///////////////////////// Data Structures   //////////////////////////////////////////////////////
 
@@ -21,12 +22,15 @@ typedef struct Session_t {
 	char username[20];				// client's username
 	char chatroom[20];				// client's chatroom name
 
-	Message messages[25];			// messages receiveed from the server
+	Message messages[CLIENT_UPDATE_MESSAGES];	// messages receiveed from the server
 	u_int32_t numOfMessages;		// number of valid messages in my session
 
 	char listOfParticipants[MAX_PARTICIPANTS][20];	// list of chatroom participants
 	u_int32_t numOfParticipants;	// number of valid participants of the chatroom
 
+	u_int32_t version;				// version of the chatroom the messages and participants reflect
+	u_int32_t synced;				// if a full update was received since joining (deltas apply on top of it)
+
 } Session;
 
 ///////////////////////// Global Variables //////////////////////////////////////////////////////
@@ -56,6 +60,8 @@ static int handle_membership_status();
 static int parse(char *message, int size, int num_groups);
 static int handle_membership_message(char *sender, int num_groups, membership_info *mem_info, int service_type);
 static int handle_update_response(char *message, int size, int num_groups);
+static int applyDelta(wireReader *r);
+static int handle_delta_response(char *message, int size);
 static int handle_history_response(char *message, int size);
 static int handle_membership_status_response(char *message, int size, int num_groups);
 
@@ -408,6 +414,8 @@ static int initialize() {
 	current_session.connected_server = 0;
 	current_session.is_connected = 0;
 	current_session.numOfMessages = 0;
+	current_session.version = 0;
+	current_session.synced = 0;
 	log_debug("list of participants initialized");
 	return 0;
 }
@@ -416,38 +424,42 @@ static int initialize() {
 
 // send a generic message of type <type> to server
 // the username and type are appended to every message we send
-static int sendToServer(char type, char *payload, u_int32_t size) {
-	char serverPrivateGroup[80], message[size + 26];
+static int sendToServer(char type, wireWriter *w) {
+	char serverPrivateGroup[80];
 	int ret;
 	u_int32_t username_length = (u_int32_t) strlen(current_session.username);
 	log_debug("sending to server type = %c, username length is %d", type, username_length);
-	message[0] = type;
-	memcpy(message + 1, &username_length, 4);
-	memcpy(message + 5, current_session.username, username_length);
-	memcpy(message + 5 + username_length, payload, size);
+	// the header goes in the headroom in front of the payload
+	wire_prepend_string(w, current_session.username, username_length);
+	wire_prepend_u8(w, type);
 	sprintf(serverPrivateGroup, "server%d", current_session.connected_server);
-	// print_hex(message, size + username_length + 5);
-	ret = SP_multicast(Mbox, AGREED_MESS, serverPrivateGroup, 2, size + username_length + 5, message);
-	log_debug("multicast returned with %d", ret);
+	if (wire_writer_ok(w)) {
+		ret = SP_multicast(Mbox, AGREED_MESS, serverPrivateGroup, 2, wire_size(w), wire_message(w));
+		log_debug("multicast returned with %d", ret);
+	}
+	else
+		log_error("request of type %c is too large to send", type);
+	wire_writer_release(w);
 	return 0;
 }
 
 // connect to a server
 static int sendConnectionRequestToServer() {
+	wireWriter w;
 	log_debug("sending connection request to server");
-	sendToServer(TYPE_CONNECT, "", 0);
+	wire_writer_init(&w);
+	sendToServer(TYPE_CONNECT, &w);
 	return 0;
 
 }
 
 // end join request. we append the chatroom name as payload
 static int sendJoinRequestToServer(char *chatroom) {
-	int length = strlen(chatroom);
-	char payload[length + 4];
+	wireWriter w;
 	log_debug("sending join request to server for chatroom = %s", chatroom);
-	memcpy(payload, &length, 4);
-	memcpy(payload + 4, chatroom, length);
-	sendToServer(TYPE_JOIN, payload, length + 4);
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, strlen(chatroom));
+	sendToServer(TYPE_JOIN, &w);
 	return 0;
 
 }
@@ -456,13 +468,12 @@ static int sendJoinRequestToServer(char *chatroom) {
 static int sendAppendRequestToServer(char *chatroom, char *message) {
 	int c_length = strlen(chatroom);
 	int m_length = strlen(message);
-	char payload[c_length + m_length + 8];
+	wireWriter w;
 	log_debug("sending append request to server for chatroom = %s (%d), message = %s (%d)", chatroom, c_length, message, m_length);
-	memcpy(payload, &c_length, 4);
-	memcpy(payload + 4, chatroom, c_length);
-	memcpy(payload + 4 + c_length, &m_length, 4);
-	memcpy(payload + 8 + c_length, message, m_length);
-	sendToServer(TYPE_APPEND, payload, c_length + m_length + 8);
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, c_length);
+	wire_write_string(&w, message, m_length);
+	sendToServer(TYPE_APPEND, &w);
 	return 0;
 
 }
@@ -471,32 +482,42 @@ static int sendAppendRequestToServer(char *chatroom, char *message) {
 // type is  either TYPE_LIKE or TYPE_UNLIKE 
 static int sendLikeUnlikeRequestToServer(u_int32_t pid, u_int32_t counter, char *chatroom, char type) {
 	u_int32_t c_length = strlen(chatroom);
-	char payload[c_length + 12];
+	wireWriter w;
 	log_debug("sending %c request to server for chatroom = %s (length=%d), message LTS = %d,%d", type, chatroom, c_length, pid, counter);
-	memcpy(payload, &c_length, 4);
-	memcpy(payload + 4, chatroom, c_length);
-	memcpy(payload + 4 + c_length, &pid, 4);
-	memcpy(payload + 8 + c_length, &counter, 4);
-	// print_hex(payload, 12 + c_length);
-	sendToServer(type, payload, c_length + 12);
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, c_length);
+	wire_write_u32(&w, pid);
+	wire_write_u32(&w, counter);
+	sendToServer(type, &w);
 	return 0;
 }
 
 // request history of the <chatroom>
 static int sendHistoryRequestToServer(char *chatroom) {
-	u_int32_t length = strlen(chatroom);
-	char payload[length + 4];
+	wireWriter w;
 	log_debug("sending history request to server for chatroom = %s", chatroom);
-	memcpy(payload, &length, 4);
-	memcpy(payload + 4, chatroom, length);
-	sendToServer(TYPE_HISTORY, payload, length + 4);
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, strlen(chatroom));
+	sendToServer(TYPE_HISTORY, &w);
+	return 0;
+}
+
+// request the full state of <chatroom> after missing one of its deltas
+static int sendResyncRequestToServer(char *chatroom) {
+	wireWriter w;
+	log_debug("sending resync request to server for chatroom = %s", chatroom);
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, strlen(chatroom));
+	sendToServer(TYPE_RESYNC, &w);
 	return 0;
 }
 
 // request current server membership status (v)
 static int sendMembershipRequestToServer() {
+	wireWriter w;
 	log_debug("sending membership status request to server ");
-	sendToServer(TYPE_MEMBERSHIP_STATUS, "", 0);
+	wire_writer_init(&w);
+	sendToServer(TYPE_MEMBERSHIP_STATUS, &w);
 	return 0;
 }
 
@@ -582,7 +603,10 @@ static int join(char *chatroom) {
 		SP_error(ret);
 	sendJoinRequestToServer(chatroom);
 	memcpy(current_session.chatroom, chatroom, strlen(chatroom));
+	current_session.chatroom[strlen(chatroom)] = 0;
     current_session.is_joined = 1;
+	// deltas are ignored until the server sends the full state of the new chatroom
+	current_session.synced = 0;
 	return 0;
 }
 
@@ -624,6 +648,9 @@ static int parse(char *message, int size, int num_groups) {
 	case TYPE_CLIENT_UPDATE:
 		handle_update_response(message, size, num_groups);
 		break;
+	case TYPE_CLIENT_DELTA:
+		handle_delta_response(message, size);
+		break;
 	case TYPE_MEMBERSHIP_STATUS_RESPONSE:
 		handle_membership_status_response(message, size, num_groups);
 		break;
@@ -709,44 +736,148 @@ static void displayMessages(){
 	//Print_menu();
 }
 
-// an update is received from server. parse and update chatroom messages and display them to the user
+// reads a message of a client update, delta or history response into <m>. returns 0 if it is cut short
+static int parseMessage(wireReader *r, Message *m) {
+	m->serverID = wire_read_u32(r);
+	m->lamportCounter = wire_read_u32(r);
+	wire_string_copy(wire_read_string(r), m->userName, sizeof(m->userName));
+	wire_string_copy(wire_read_string(r), m->message, sizeof(m->message));
+	m->numOfLikes = wire_read_u32(r);
+	log_debug("parsed message %d, %d from %s: %s (%d likes)", m->serverID, m->lamportCounter, m->userName, m->message, m->numOfLikes);
+	return wire_reader_ok(r);
+}
+
+// the full state of the chatroom is received from server. replace our messages and participants and display them to the user
 static int handle_update_response(char *message, int size, int num_groups) {
-	u_int32_t username_size, num_messages, messageSize;
-	int offset = 5;
-	int i, pointer = 0;
+	u_int32_t num_participants, num_messages, version;
+	int i;
+	wireString username;
+	wireReader r;
 	log_debug("Handling client update message");
-	memcpy(&current_session.numOfParticipants, message + 1, 4);
-	log_debug("Parsed number of participants %d", current_session.numOfParticipants);
-	for (i = 0; i < current_session.numOfParticipants; i++) {
-		memcpy(&username_size, message + offset, 4);
-        log_debug("username size is %d", username_size);
-		memcpy(&current_session.listOfParticipants[i], message + offset + 4, username_size);
-        current_session.listOfParticipants[i][username_size] = 0;
-        log_debug("added %s to list of participants", current_session.listOfParticipants[i]);
-		offset += (4+username_size);
+	wire_reader_init(&r, message + 1, size - 1);
+	version = wire_read_u32(&r);
+	num_participants = wire_read_u32(&r);
+	log_debug("Parsed version %d, number of participants %d", version, num_participants);
+	current_session.numOfParticipants = 0;
+	for (i = 0; i < num_participants && wire_reader_ok(&r); i++) {
+		username = wire_read_string(&r);
+		if (current_session.numOfParticipants < MAX_PARTICIPANTS &&
+			wire_string_copy(username, current_session.listOfParticipants[current_session.numOfParticipants], 20)) {
+			log_debug("added %s to list of participants", current_session.listOfParticipants[current_session.numOfParticipants]);
+			current_session.numOfParticipants++;
+		}
 	}
-	memcpy(&num_messages, message + offset, 4);
-    offset +=4;
+	num_messages = wire_read_u32(&r);
 	log_debug("Parsed number of messages %d", num_messages);
-	for (i = 0; i < num_messages; i++){
-		memcpy(&current_session.messages[i].serverID, message + offset + pointer, 4);
-        log_debug("server ID = %d", current_session.messages[i].serverID);
-		memcpy(&current_session.messages[i].lamportCounter, message + offset + pointer + 4, 4);
-        log_debug("lamport = %d", current_session.messages[i].lamportCounter);
-      
-        memcpy(&username_size, message + offset + pointer + 8, 4); 
-        memcpy(current_session.messages[i].userName, message + offset + pointer + 12, username_size);
-        current_session.messages[i].userName[username_size] = 0;
-        log_debug("message uname is %s", current_session.messages[i].userName);
-        pointer += (12 + username_size);
-		memcpy(&messageSize, message + offset + pointer, 4);
-        log_debug("m size = %d", messageSize);
-		memcpy(&current_session.messages[i].message, message + offset + pointer +4, messageSize);
-        current_session.messages[i].message[messageSize] = 0;
-		memcpy(&current_session.messages[i].numOfLikes, message + offset + pointer + 4 + messageSize, 4);
-		pointer += (8 + messageSize);
+	if (num_messages > CLIENT_UPDATE_MESSAGES)
+		num_messages = CLIENT_UPDATE_MESSAGES;
+	for (i = 0; i < num_messages && parseMessage(&r, &current_session.messages[i]); i++)
+		;
+	current_session.numOfMessages = i;
+	if (!wire_reader_ok(&r)) {
+		// keep what was read, but the next delta cannot be applied on top of it
+		log_error("truncated update of chatroom %s. requesting the full state again", current_session.chatroom);
+		current_session.synced = 0;
+		sendResyncRequestToServer(current_session.chatroom);
+		displayMessages();
+		return 0;
+	}
+	current_session.version = version;
+	current_session.synced = 1;
+	displayMessages();
+	return 0;
+}
+
+// finds the participant <username>. returns its index or -1
+static int findParticipant(char *username) {
+	int i;
+	for (i = 0; i < current_session.numOfParticipants; i++)
+		if (!strcmp(current_session.listOfParticipants[i], username))
+			return i;
+	return -1;
+}
+
+// reads the next change (its type and fields) and applies it to our state. returns 0 if it is invalid or cut short
+static int applyDelta(wireReader *r) {
+	u_int32_t pid, counter, likes, keep;
+	char username[20];
+	Message m;
+	int i;
+	char type = wire_read_u8(r);
+	switch (type) {
+	case DELTA_MESSAGE:
+		parseMessage(r, &m);
+		keep = wire_read_u32(r);
+		if (!wire_reader_ok(r))
+			return 0;
+		if (current_session.numOfMessages == CLIENT_UPDATE_MESSAGES) {
+			memmove(current_session.messages, current_session.messages + 1, (CLIENT_UPDATE_MESSAGES - 1) * sizeof(Message));
+			current_session.numOfMessages--;
+		}
+		current_session.messages[current_session.numOfMessages++] = m;
+		// the server may keep fewer messages than a client shows
+		if (keep < current_session.numOfMessages) {
+			memmove(current_session.messages, current_session.messages + current_session.numOfMessages - keep, keep * sizeof(Message));
+			current_session.numOfMessages = keep;
+		}
+		return 1;
+	case DELTA_LIKES:
+		pid = wire_read_u32(r);
+		counter = wire_read_u32(r);
+		likes = wire_read_u32(r);
+		if (!wire_reader_ok(r))
+			return 0;
+		for (i = 0; i < current_session.numOfMessages; i++)
+			if (current_session.messages[i].serverID == pid && current_session.messages[i].lamportCounter == counter)
+				current_session.messages[i].numOfLikes = likes;
+		return 1;
+	case DELTA_PARTICIPANT_JOINED:
+	case DELTA_PARTICIPANT_LEFT:
+		if (!wire_string_copy(wire_read_string(r), username, sizeof(username)))
+			return 0;
+		i = findParticipant(username);
+		if (type == DELTA_PARTICIPANT_JOINED && i == -1 && current_session.numOfParticipants < MAX_PARTICIPANTS)
+			strcpy(current_session.listOfParticipants[current_session.numOfParticipants++], username);
+		else if (type == DELTA_PARTICIPANT_LEFT && i != -1) {
+			current_session.numOfParticipants--;
+			if (i != current_session.numOfParticipants)
+				strcpy(current_session.listOfParticipants[i], current_session.listOfParticipants[current_session.numOfParticipants]);
+		}
+		return 1;
+	default:
+		log_error("Invalid delta type received from server %c", type);
+		return 0;
+	}
+}
+
+// the changes of the chatroom since the previous version are received from server. apply them on top of our state
+// if this is the next version, otherwise ask the server for the full state
+static int handle_delta_response(char *message, int size) {
+	u_int32_t version, num_deltas, i;
+	wireReader r;
+	wire_reader_init(&r, message + 1, size - 1);
+	version = wire_read_u32(&r);
+	num_deltas = wire_read_u32(&r);
+	if (!wire_reader_ok(&r))
+		return 0;
+	log_debug("Handling client delta of %d changes, version %d (we have %d)", num_deltas, version, current_session.version);
+	if (!current_session.synced || version <= current_session.version)
+		return 0;	// waiting for the full state, or already reflected in it
+	if (version != current_session.version + 1) {
+		log_warn("missed updates of chatroom %s (version %d after %d). requesting the full state", current_session.chatroom, version, current_session.version);
+		current_session.synced = 0;
+		sendResyncRequestToServer(current_session.chatroom);
+		return 0;
+	}
+	current_session.version = version;
+	for (i = 0; i < num_deltas; i++) {
+		if (!applyDelta(&r)) {
+			log_warn("invalid delta of chatroom %s. requesting the full state", current_session.chatroom);
+			current_session.synced = 0;
+			sendResyncRequestToServer(current_session.chatroom);
+			break;
+		}
 	}
-	current_session.numOfMessages = num_messages;
 	displayMessages();
 	return 0;
 }
@@ -767,14 +898,21 @@ static void displayMembershipStatus(u_int32_t *list, u_int32_t size) {
 }
 
 static int handle_membership_status_response(char *message, int size, int num_groups) {
-
 	u_int32_t numOfMembers;
-	memcpy(&numOfMembers, message + 1, 4);
-	u_int32_t membersList[numOfMembers];
+	u_int32_t membersList[NUM_SERVERS];
 	int i;
+	wireReader r;
 	log_debug("Handling membership status response");
+	wire_reader_init(&r, message + 1, size - 1);
+	numOfMembers = wire_read_u32(&r);
+	if (numOfMembers > NUM_SERVERS)
+		numOfMembers = NUM_SERVERS;
 	for (i = 0; i < numOfMembers; i++) {
-		memcpy(&membersList[i], message + 5 + (4 * i), 4);
+		membersList[i] = wire_read_u32(&r);
+	}
+	if (!wire_reader_ok(&r)) {
+		log_error("invalid membership status response");
+		return 0;
 	}
 	displayMembershipStatus(membersList, numOfMembers);
 	return 0;
@@ -797,32 +935,25 @@ static void displayHistory(Message *messages, u_int32_t num_of_messages){
 }
 
 static int handle_history_response(char *message, int size) {
-	u_int32_t username_size, num_messages, messageSize;
-	int offset = 5;
-	int i, pointer = 0;
+	u_int32_t num_messages, skipped = 0;
+	int i;
+	wireReader r;
+	Message m;
 	log_debug("Handling client history response message");
 	Message messages[MAX_HISTORY_MESSAGES];
 
-	memcpy(&num_messages, message + 1, 4);
+	wire_reader_init(&r, message + 1, size - 1);
+	num_messages = wire_read_u32(&r);
 	log_debug("Parsed number of messages %d", num_messages);
-	for (i = 0; i < num_messages; i++){
-		memcpy(&messages[i].serverID, message + offset + pointer, 4);
-        log_debug("server ID = %d", &messages[i].serverID);
-		memcpy(&messages[i].lamportCounter, message + offset + pointer + 4, 4);
-        log_debug("lamport = %d", &messages[i].lamportCounter);
-      
-        memcpy(&username_size, message + offset + pointer + 8, 4); 
-        memcpy(messages[i].userName, message + offset + pointer + 12, username_size);
-        messages[i].userName[username_size] = 0;
-        log_debug("message uname is %s", messages[i].userName);
-        pointer += (12 + username_size);
-		memcpy(&messageSize, message + offset + pointer, 4);
-        log_debug("m size = %d", messageSize);
-		memcpy(&messages[i].message, message + offset + pointer +4, messageSize);
-        messages[i].message[messageSize] = 0;
-		memcpy(&messages[i].numOfLikes, message + offset + pointer + 4 + messageSize, 4);
-		pointer += (8 + messageSize);
-	}
-	displayHistory(messages, num_messages);
+	// only the most recent MAX_HISTORY_MESSAGES are shown
+	if (num_messages > MAX_HISTORY_MESSAGES)
+		skipped = num_messages - MAX_HISTORY_MESSAGES;
+	for (i = 0; i < skipped && parseMessage(&r, &m); i++)
+		;
+	for (i = 0; i < num_messages - skipped && parseMessage(&r, &messages[i]); i++)
+		;
+	if (!wire_reader_ok(&r))
+		log_error("truncated history response, showing %d of %d messages", i, num_messages - skipped);
+	displayHistory(messages, i);
 	return 0;
 }
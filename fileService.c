@@ -1,67 +1,1728 @@
+#define _GNU_SOURCE
 #include "fileService.h"
+#include "wireCodec.h"
+
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+// records appended to a log file but not committed yet (group commit)
+typedef struct {
+    char *buffer;
+    u_int32_t length;
+    u_int32_t capacity;
+    u_int32_t records;
+} pendingAppends;
+
+// a callback waiting for the records appended before it to be committed
+typedef struct logCommitCallback_t {
+    diskCallback done;
+    void *arg;
+    struct logCommitCallback_t *next;
+} logCommitCallback;
+
+typedef struct {
+    int fd;
+    char *buffer;
+    u_int32_t length;
+    u_int64_t offset;
+} logWrite;
+
+// one commit handed to the disk thread: a write per log file, optionally followed by fdatasync
+typedef struct {
+    logWrite *writes;
+    u_int32_t num_of_writes;
+    int sync;
+    u_int32_t records;
+    u_int32_t bytes;
+    u_int64_t latency_usec;         // time the disk thread spent in write + fdatasync
+    logCommitCallback *callbacks;   // run once the commit is done
+} logCommit;
+
+// a line appended to a chatroom archive on the disk thread
+typedef struct {
+    chatroomArchive *archive;
+    u_int32_t length;
+    char line[];
+} chatroomAppend;
+
+// an entry of a likes journal: a like or unlike of an archived line
+typedef struct {
+    u_int32_t line;
+    u_int32_t server_id;    // LTS of the message on the line, checked when the entry is read
+    u_int32_t lamport_counter;
+    char type;              // TYPE_LIKE or TYPE_UNLIKE
+    char username[20];
+    u_int64_t previous;     // offset + 1 of the previous entry of the line, 0 if there is none
+} archivedLike;
+
+// an entry appended to a likes journal on the disk thread
+typedef struct {
+    chatroomArchive *archive;
+    archivedLike like;
+} chatroomLike;
+
+// a read of the last messages of a chatroom archive on the disk thread
+typedef struct {
+    chatroomArchive *archive;   // NULL if there is nothing to read
+    u_int32_t first;        // first line to read
+    u_int64_t size;         // end of the archive, as of the read
+    u_int64_t likes_size;   // end of the likes journal, as of the read
+    u_int32_t max_messages;
+    u_int32_t *num_of_messages;
+    Message *messages;
+    diskCallback done;
+    void *arg;
+} chatroomHistoryRead;
+
+logSegments * log_segments;
+logIndex * log_indexes;
+static u_int32_t log_files_owner;   // the server id in our log file names
+static u_int32_t num_of_log_files;
+static u_int64_t *log_sizes;         // end of the records in each active segment, including pending appends
+static pendingAppends *pending_appends;
+static u_int32_t pending_records;    // pending records over all log files
+static struct timeval oldest_pending; // when the oldest pending record was appended
+static logCommitCallback *pending_callbacks;        // waiting for the pending records
+static logCommitCallback *pending_callbacks_tail;
+
+static enum LogDurability log_durability = LOG_DURABILITY_GROUP;
+static u_int32_t group_commit_records = LOG_GROUP_COMMIT_RECORDS;
+static u_int32_t group_commit_usec = LOG_GROUP_COMMIT_USEC;
+static logCommitStats commit_stats;
+
+static chatroomFile chatroom_files[CHATROOM_FILE_CACHE_SIZE];
+static chatroomFile *chatroom_files_mru;    // head of the LRU list
+static chatroomFile *chatroom_files_lru;    // tail of the LRU list, evicted first
+static u_int32_t num_of_chatroom_files;
+
+static u_int64_t elapsed_usec(struct timeval *since)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000ULL + now.tv_usec - since->tv_usec;
+}
+
+// a batch of independent jobs run by a pool of threads
+typedef struct {
+    void (*job)(u_int32_t, void *);
+    void *arg;
+    u_int32_t num_of_jobs;
+    u_int32_t next_job;     // next job to be claimed by a thread
+    pthread_mutex_t lock;
+} parallelJobs;
+
+static void *parallel_worker(void *arg)
+{
+    parallelJobs *jobs = (parallelJobs *) arg;
+    u_int32_t job;
+    while (1)
+    {
+        pthread_mutex_lock(&jobs->lock);
+        job = jobs->next_job++;
+        pthread_mutex_unlock(&jobs->lock);
+        if(job >= jobs->num_of_jobs)
+            return NULL;
+        jobs->job(job, jobs->arg);
+    }
+}
+
+// runs job(0, arg) ... job(num_of_jobs - 1, arg) on up to <num_threads> threads and waits for all of them.
+// the jobs must only touch their own data
+static void run_parallel(int num_threads, u_int32_t num_of_jobs, void (*job)(u_int32_t, void *), void *arg)
+{
+    parallelJobs jobs;
+    int i, started = 0;
+    if(num_threads > num_of_jobs)
+        num_threads = num_of_jobs;
+    pthread_t threads[num_threads > 0 ? num_threads : 1];
+    jobs.job = job;
+    jobs.arg = arg;
+    jobs.num_of_jobs = num_of_jobs;
+    jobs.next_job = 0;
+    pthread_mutex_init(&jobs.lock, NULL);
+    for(i = 1; i < num_threads; i++)
+        if(pthread_create(&threads[started], NULL, parallel_worker, &jobs) == 0)
+            started++;
+    parallel_worker(&jobs);     // the calling thread works too
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&jobs.lock);
+}
+
+// number of threads used for startup recovery (RECOVERY_THREADS, or one per online cpu if it is 0)
+int get_recovery_threads()
+{
+    long cpus;
+    if(RECOVERY_THREADS > 0)
+        return RECOVERY_THREADS;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+// a unit of work for the disk thread: <work> runs on the disk thread, then <done> on the event loop thread
+typedef struct diskJob_t {
+    diskCallback work;
+    diskCallback done;
+    void *arg;
+    struct diskJob_t *next;
+} diskJob;
+
+// FIFO of submitted jobs and of finished ones waiting for their <done> callback
+typedef struct {
+    diskJob *head, *tail;
+    diskJob *finished_head, *finished_tail;
+    u_int32_t outstanding;      // submitted jobs that have not finished yet
+    int started;
+    int completion_pipe[2];     // a byte is written when the finished list becomes non-empty
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t idle;
+} diskQueue;
+
+static diskQueue disk_queue = { .completion_pipe = { -1, -1 } };
+
+static void *disk_worker(void *arg)
+{
+    diskJob *job;
+    char signal = 0;
+    while (1)
+    {
+        pthread_mutex_lock(&disk_queue.lock);
+        while (disk_queue.head == NULL)
+            pthread_cond_wait(&disk_queue.submitted, &disk_queue.lock);
+        job = disk_queue.head;
+        disk_queue.head = job->next;
+        if(disk_queue.head == NULL)
+            disk_queue.tail = NULL;
+        pthread_mutex_unlock(&disk_queue.lock);
+
+        if(job->work)
+            job->work(job->arg);
+
+        job->next = NULL;
+        pthread_mutex_lock(&disk_queue.lock);
+        if(disk_queue.finished_tail)
+            disk_queue.finished_tail->next = job;
+        else
+        {
+            disk_queue.finished_head = job;
+            if(write(disk_queue.completion_pipe[1], &signal, 1) < 0)
+                log_error("could not signal disk completion: %s", strerror(errno));
+        }
+        disk_queue.finished_tail = job;
+        if(--disk_queue.outstanding == 0)
+            pthread_cond_broadcast(&disk_queue.idle);
+        pthread_mutex_unlock(&disk_queue.lock);
+    }
+    return NULL;
+}
+
+// starts the disk thread. returns the descriptor that becomes readable when run_disk_completions() has work,
+// or -1 if disk I/O runs inline (DISK_WRITER_THREAD is 0 or the thread could not be started)
+int start_disk_writer()
+{
+    if(!DISK_WRITER_THREAD || disk_queue.started)
+        return disk_queue.completion_pipe[0];
+    if(pipe(disk_queue.completion_pipe) < 0)
+    {
+        log_error("could not create disk completion pipe: %s", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&disk_queue.lock, NULL);
+    pthread_cond_init(&disk_queue.submitted, NULL);
+    pthread_cond_init(&disk_queue.idle, NULL);
+    if(pthread_create(&disk_queue.thread, NULL, disk_worker, NULL) != 0)
+    {
+        log_error("could not start disk thread, disk I/O runs inline");
+        close(disk_queue.completion_pipe[0]);
+        close(disk_queue.completion_pipe[1]);
+        disk_queue.completion_pipe[0] = disk_queue.completion_pipe[1] = -1;
+        return -1;
+    }
+    disk_queue.started = 1;
+    log_info("disk thread started");
+    return disk_queue.completion_pipe[0];
+}
+
+// queues <work> for the disk thread. jobs run one at a time in submission order
+// without the disk thread, <work> and <done> run right away
+static void submit_disk_job(diskCallback work, diskCallback done, void *arg)
+{
+    diskJob *job;
+    if(!disk_queue.started)
+    {
+        if(work)
+            work(arg);
+        if(done)
+            done(arg);
+        return;
+    }
+    job = (diskJob *) malloc(sizeof(diskJob));
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&disk_queue.lock);
+    if(disk_queue.tail)
+        disk_queue.tail->next = job;
+    else
+        disk_queue.head = job;
+    disk_queue.tail = job;
+    disk_queue.outstanding++;
+    pthread_cond_signal(&disk_queue.submitted);
+    pthread_mutex_unlock(&disk_queue.lock);
+}
+
+// runs the <done> callbacks of the finished disk jobs, in submission order (event loop thread only)
+void run_disk_completions()
+{
+    diskJob *job, *next;
+    char signal;
+    if(!disk_queue.started)
+        return;
+    pthread_mutex_lock(&disk_queue.lock);
+    job = disk_queue.finished_head;
+    if(job && read(disk_queue.completion_pipe[0], &signal, 1) < 0)
+        log_error("could not read disk completion: %s", strerror(errno));
+    disk_queue.finished_head = disk_queue.finished_tail = NULL;
+    pthread_mutex_unlock(&disk_queue.lock);
+    for(; job != NULL; job = next)
+    {
+        next = job->next;
+        if(job->done)
+            job->done(job->arg);
+        free(job);
+    }
+}
+
+// blocks until the disk thread has finished every submitted job.
+// only used at startup and shutdown: the event loop thread otherwise queues its reads and closes behind the jobs
+void wait_disk_writes()
+{
+    if(!disk_queue.started)
+        return;
+    pthread_mutex_lock(&disk_queue.lock);
+    while (disk_queue.outstanding > 0)
+        pthread_cond_wait(&disk_queue.idle, &disk_queue.lock);
+    pthread_mutex_unlock(&disk_queue.lock);
+}
+
+// write() that retries on short writes and interrupts
+static int write_fully(int fd, char *buffer, u_int32_t length)
+{
+    ssize_t written;
+    while (length > 0)
+    {
+        written = write(fd, buffer, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            log_error("log write failed: %s", strerror(errno));
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// reads <length> bytes at <offset> of <fd>. returns the number of bytes read
+static ssize_t read_fully(int fd, char *buffer, size_t length, off_t offset)
+{
+    ssize_t n, total = 0;
+    while (total < length)
+    {
+        n = pread(fd, buffer + total, length - total, offset + total);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+// pwrite() of <length> bytes at <offset>, retrying on short writes and interrupts
+static int pwrite_fully(int fd, char *buffer, u_int32_t length, off_t offset)
+{
+    ssize_t written;
+    while (length > 0)
+    {
+        written = pwrite(fd, buffer, length, offset);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            log_error("log write failed: %s", strerror(errno));
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
 
 void get_chatroom_file_name(u_int32_t me, char *chatroom, char *filename)
 {
-    sprintf(filename, "%d_%s.chatroom", me, chatroom);
+    sprintf(filename, "%d_%s.chatroom", me, chatroom);
+}
+
+static void get_log_segment_name(u_int32_t server_id, u_int32_t segment, char *filename)
+{
+    sprintf(filename, "%d_server%d.%06u.log", log_files_owner, server_id, segment);
+}
+
+static void get_spare_log_segment_name(u_int32_t server_id, u_int32_t segment, char *filename)
+{
+    sprintf(filename, "%d_server%d.%06u.new", log_files_owner, server_id, segment);
+}
+
+static logSegmentFooter *get_log_segment_footer(u_int32_t server_id, u_int32_t segment)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    return &s->footers[segment - s->first_segment];
+}
+
+// adds a record ending at <end> to the footer of its segment
+static void account_log_segment_record(logSegmentFooter *footer, u_int32_t lamport_counter, u_int64_t end)
+{
+    if(footer->num_of_records == 0 || lamport_counter < footer->first_lamport_counter)
+        footer->first_lamport_counter = lamport_counter;
+    if(footer->num_of_records == 0 || lamport_counter > footer->last_lamport_counter)
+        footer->last_lamport_counter = lamport_counter;
+    footer->num_of_records++;
+    footer->data_size = end;
+}
+
+// entries written to a sidecar index on the disk thread, at entry <first> of the file.
+// with <truncate>, the index is cut after them
+typedef struct {
+    int fd;
+    int truncate;
+    u_int32_t first;
+    u_int32_t num_of_entries;
+    logIndexEntry entries[];
+} logIndexWrite;
+
+static void write_log_index(void *arg)  // disk thread
+{
+    logIndexWrite *w = (logIndexWrite *) arg;
+    u_int64_t end = (u_int64_t) (w->first + w->num_of_entries) * sizeof(logIndexEntry);
+    pwrite_fully(w->fd, (char *) w->entries, w->num_of_entries * sizeof(logIndexEntry), (u_int64_t) w->first * sizeof(logIndexEntry));
+    if(w->truncate && ftruncate(w->fd, end) < 0)
+        log_error("could not truncate log index: %s", strerror(errno));
+}
+
+// queues the write of the in-memory entries <first>... of the index of log <server_id>
+static void queue_log_index_write(u_int32_t server_id, u_int32_t first, int truncate)
+{
+    logIndex *idx = &log_indexes[server_id - 1];
+    logIndexWrite *w = (logIndexWrite *) malloc(sizeof(logIndexWrite) + (idx->num_of_entries - first) * sizeof(logIndexEntry));
+    w->fd = idx->fd;
+    w->truncate = truncate;
+    w->first = first;
+    w->num_of_entries = idx->num_of_entries - first;
+    memcpy(w->entries, idx->entries + first, w->num_of_entries * sizeof(logIndexEntry));
+    submit_disk_job(write_log_index, free, w);
+}
+
+// registers the record at <offset> of <segment> of log <server_id> in the sparse index
+// a new index entry is written for every LOG_INDEX_INTERVAL records
+static void index_log_record(u_int32_t server_id, u_int32_t lamport_counter, u_int32_t segment, u_int64_t offset)
+{
+    logIndex *idx = &log_indexes[server_id - 1];
+    logIndexEntry entry;
+    if(idx->num_of_entries == 0 || idx->records_since_entry >= LOG_INDEX_INTERVAL)
+    {
+        if(idx->num_of_entries == idx->capacity)
+        {
+            idx->capacity = idx->capacity ? idx->capacity * 2 : 64;
+            idx->entries = (logIndexEntry *) realloc(idx->entries, idx->capacity * sizeof(logIndexEntry));
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.lamportCounter = lamport_counter;
+        entry.segment = segment;
+        entry.offset = offset;
+        idx->entries[idx->num_of_entries++] = entry;
+        idx->records_since_entry = 0;
+        queue_log_index_write(server_id, idx->num_of_entries - 1, 0);
+    }
+    idx->records_since_entry++;
+}
+
+// rewrites the sidecar index of log <server_id> from memory
+static void rewrite_log_index(u_int32_t server_id)
+{
+    queue_log_index_write(server_id, 0, 1);
+}
+
+// reads the records of <segment> of log <server_id> from <offset> on.
+// with <footer>, the records are added to it; with <index>, the records after the last index entry are indexed.
+// returns the end of the last complete record
+static u_int64_t scan_log_segment(u_int32_t server_id, u_int32_t segment, u_int64_t offset, logSegmentFooter *footer, int index)
+{
+    logIndex *idx = &log_indexes[server_id - 1];
+    char filename[40];
+    logEvent e;
+    u_int64_t end;
+    FILE *fp;
+    get_log_segment_name(server_id, segment, filename);
+    fp = fopen(filename, "r");
+    if(fp == NULL)
+    {
+        log_error("could not open log segment %s", filename);
+        return offset;
+    }
+    fseek(fp, offset, SEEK_SET);
+    while (read_log_record(fp, &e))
+    {
+        end = ftell(fp);
+        if(footer)
+            account_log_segment_record(footer, e.lamportCounter, end);
+        if(index)
+        {
+            // the record of the last index entry was indexed already
+            if(idx->num_of_entries && idx->entries[idx->num_of_entries - 1].segment == segment && idx->entries[idx->num_of_entries - 1].offset == offset)
+                idx->records_since_entry = 1;
+            else
+                index_log_record(server_id, e.lamportCounter, segment, offset);
+        }
+        offset = end;
+    }
+    fclose(fp);
+    return offset;
+}
+
+// makes room for the footer of one more live segment of log <server_id>
+static logSegmentFooter *add_log_segment_footer(u_int32_t server_id)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    u_int32_t n = s->active_segment - s->first_segment + 1;
+    if(n > s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 16;
+        s->footers = (logSegmentFooter *) realloc(s->footers, s->capacity * sizeof(logSegmentFooter));
+    }
+    memset(&s->footers[n - 1], 0, sizeof(logSegmentFooter));
+    return &s->footers[n - 1];
+}
+
+// preallocates LOG_SEGMENT_SIZE bytes for a segment, so appends do not change its size
+static void preallocate_log_segment(int fd)
+{
+    if(fallocate(fd, 0, 0, LOG_SEGMENT_SIZE) < 0)
+    {
+        // the file system cannot allocate ahead, at least fix the size
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size < LOG_SEGMENT_SIZE && ftruncate(fd, LOG_SEGMENT_SIZE) < 0)
+            log_error("could not preallocate log segment: %s", strerror(errno));
+    }
+}
+
+static void preallocate_log_segment_job(void *arg)  // disk thread
+{
+    preallocate_log_segment(*(int *) arg);
+}
+
+// the next segment of a log, created on the disk thread before it is needed
+typedef struct {
+    u_int32_t server_id;
+    u_int32_t segment;
+    int fd;
+} logSegmentSpare;
+
+static void create_spare_log_segment(void *arg)  // disk thread
+{
+    logSegmentSpare *spare = (logSegmentSpare *) arg;
+    char filename[40];
+    get_spare_log_segment_name(spare->server_id, spare->segment, filename);
+    spare->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(spare->fd < 0)
+    {
+        log_error("could not create log segment %s: %s", filename, strerror(errno));
+        return;
+    }
+    preallocate_log_segment(spare->fd);
+}
+
+static void discard_spare_log_segment(void *arg)  // disk thread
+{
+    logSegmentSpare *spare = (logSegmentSpare *) arg;
+    char filename[40];
+    get_spare_log_segment_name(spare->server_id, spare->segment, filename);
+    close(spare->fd);
+    unlink(filename);
+}
+
+static void activate_spare_log_segment(void *arg)  // disk thread
+{
+    logSegmentSpare *spare = (logSegmentSpare *) arg;
+    char spare_filename[40], filename[40];
+    get_spare_log_segment_name(spare->server_id, spare->segment, spare_filename);
+    get_log_segment_name(spare->server_id, spare->segment, filename);
+    if(rename(spare_filename, filename) < 0)
+        log_error("could not rename log segment %s: %s", spare_filename, strerror(errno));
+}
+
+static void spare_log_segment_created(void *arg)
+{
+    logSegmentSpare *spare = (logSegmentSpare *) arg;
+    logSegments *s = &log_segments[spare->server_id - 1];
+    s->creating_spare = 0;
+    if(spare->fd >= 0 && spare->segment == s->active_segment + 1)
+    {
+        s->spare_fd = spare->fd;
+        free(spare);
+    }
+    else if(spare->fd >= 0)
+        submit_disk_job(discard_spare_log_segment, free, spare);     // appends moved on without it
+    else
+        free(spare);
+}
+
+// queues the creation of the segment after the active one of log <server_id>
+static void prepare_log_segment(u_int32_t server_id)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    logSegmentSpare *spare = (logSegmentSpare *) malloc(sizeof(logSegmentSpare));
+    spare->server_id = server_id;
+    spare->segment = s->active_segment + 1;
+    spare->fd = -1;
+    s->creating_spare = 1;
+    submit_disk_job(create_spare_log_segment, spare_log_segment_created, spare);
+}
+
+// makes segment <segment> of log <server_id> the active one.
+// the spare segment is taken if it is ready (it is renamed on the disk thread, ahead of the appends to it).
+// otherwise (at startup) the segment is created here and its preallocation is queued for the disk thread
+static void open_log_segment(u_int32_t server_id, u_int32_t segment)
+{
+    int *fd;
+    logSegments *s = &log_segments[server_id - 1];
+    logSegmentSpare *spare;
+    char filename[40];
+    get_log_segment_name(server_id, segment, filename);
+    if(s->spare_fd >= 0 && segment == s->active_segment + 1)
+    {
+        log_info("moving on to log segment %s", filename);
+        spare = (logSegmentSpare *) malloc(sizeof(logSegmentSpare));
+        spare->server_id = server_id;
+        spare->segment = segment;
+        spare->fd = s->spare_fd;
+        submit_disk_job(activate_spare_log_segment, free, spare);
+        s->fd = s->spare_fd;
+        s->spare_fd = -1;
+        s->active_segment = segment;
+        add_log_segment_footer(server_id);
+        log_sizes[server_id - 1] = 0;
+        return;
+    }
+    log_info("creating log segment %s", filename);
+    s->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(s->fd < 0)
+        log_error("could not create log segment %s: %s", filename, strerror(errno));
+    else
+    {
+        fd = (int *) malloc(sizeof(int));
+        *fd = s->fd;
+        submit_disk_job(preallocate_log_segment_job, free, fd);
+    }
+    s->active_segment = segment;
+    add_log_segment_footer(server_id);
+    log_sizes[server_id - 1] = 0;
+}
+
+// a sealed segment whose footer is written and whose descriptor is closed on the disk thread
+typedef struct {
+    int fd;
+    int sync;
+    u_int32_t server_id;
+    u_int32_t segment;
+    u_int64_t position;
+    logSegmentFooter footer;
+} logSegmentSeal;
+
+static void write_log_segment_footer(void *arg)  // disk thread
+{
+    logSegmentSeal *seal = (logSegmentSeal *) arg;
+    pwrite_fully(seal->fd, (char *) &seal->footer, sizeof(logSegmentFooter), seal->position);
+    if(seal->sync)
+        fdatasync(seal->fd);
+    close(seal->fd);
+}
+
+static void log_segment_sealed(void *arg)
+{
+    logSegmentSeal *seal = (logSegmentSeal *) arg;
+    log_info("sealed segment %u of log %d: lc %u - %u, %u records", seal->segment, seal->server_id,
+        seal->footer.first_lamport_counter, seal->footer.last_lamport_counter, seal->footer.num_of_records);
+    free(seal);
+}
+
+// writes the footer of the active segment of log <server_id> into its last bytes and closes it.
+// both are queued for the disk thread, behind the pending appends of the log
+static void seal_log_segment(u_int32_t server_id)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    logSegmentFooter *footer = get_log_segment_footer(server_id, s->active_segment);
+    logSegmentSeal *seal = (logSegmentSeal *) malloc(sizeof(logSegmentSeal));
+    seal->position = LOG_SEGMENT_SIZE - sizeof(logSegmentFooter);
+    footer->terminator = 0;
+    footer->magic = LOG_SEGMENT_MAGIC;
+    if(footer->data_size > seal->position)      // a migrated log bigger than a segment
+        seal->position = footer->data_size;
+    seal->fd = s->fd;
+    seal->sync = log_durability != LOG_DURABILITY_NONE;
+    seal->server_id = server_id;
+    seal->segment = s->active_segment;
+    seal->footer = *footer;
+    s->fd = -1;
+    submit_disk_job(write_log_segment_footer, log_segment_sealed, seal);
+}
+
+// reads the footer of a sealed segment. returns 0 if the segment has no valid footer
+static int read_log_segment_footer(u_int32_t server_id, u_int32_t segment, logSegmentFooter *footer)
+{
+    char filename[40];
+    struct stat st;
+    int fd, valid = 0;
+    get_log_segment_name(server_id, segment, filename);
+    fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    if(fstat(fd, &st) == 0 && st.st_size >= sizeof(logSegmentFooter)
+        && read_fully(fd, (char *) footer, sizeof(logSegmentFooter), st.st_size - sizeof(logSegmentFooter)) == sizeof(logSegmentFooter))
+        valid = footer->terminator == 0 && footer->magic == LOG_SEGMENT_MAGIC;
+    close(fd);
+    return valid;
+}
+
+// loads the sidecar index of log <server_id> and brings it up to date with the segments.
+// only the records after the last index entry are scanned (every segment if the index is new)
+static void load_log_index(u_int32_t server_id, char *filename, int recreate)
+{
+    logIndex *idx = &log_indexes[server_id - 1];
+    logSegments *s = &log_segments[server_id - 1];
+    logIndexEntry entry;
+    u_int32_t segment, stale = 0, last_segment = 0;
+    u_int64_t last_offset = 0;
+    int indexed;
+    u_int64_t position = 0;
+    memset(idx, 0, sizeof(logIndex));
+    idx->fd = open(filename, O_RDWR | O_CREAT | (recreate ? O_TRUNC : 0), 0644);
+    if(idx->fd < 0)
+        log_error("could not open log index %s: %s", filename, strerror(errno));
+    for(; idx->fd >= 0 && read_fully(idx->fd, (char *) &entry, sizeof(entry), position) == sizeof(entry); position += sizeof(entry))
+    {
+        // entries of retired segments
+        if(entry.segment < s->first_segment)
+        {
+            stale++;
+            continue;
+        }
+        if(idx->num_of_entries == idx->capacity)
+        {
+            idx->capacity = idx->capacity ? idx->capacity * 2 : 64;
+            idx->entries = (logIndexEntry *) realloc(idx->entries, idx->capacity * sizeof(logIndexEntry));
+        }
+        idx->entries[idx->num_of_entries++] = entry;
+    }
+    // entries written before a crash may point past the records that actually reached the disk
+    while (idx->num_of_entries && (idx->entries[idx->num_of_entries - 1].segment > s->active_segment
+        || (idx->entries[idx->num_of_entries - 1].segment == s->active_segment
+            && idx->entries[idx->num_of_entries - 1].offset >= log_sizes[server_id - 1])))
+    {
+        idx->num_of_entries--;
+        stale++;
+    }
+    if(stale)
+        rewrite_log_index(server_id);
+    indexed = idx->num_of_entries > 0;
+    if(indexed)
+    {
+        last_segment = idx->entries[idx->num_of_entries - 1].segment;
+        last_offset = idx->entries[idx->num_of_entries - 1].offset;
+    }
+    for(segment = indexed ? last_segment : s->first_segment; segment <= s->active_segment; segment++)
+        scan_log_segment(server_id, segment, indexed && segment == last_segment ? last_offset : 0, NULL, 1);
+    log_info("log index %s has %d entries", filename, idx->num_of_entries);
+}
+
+// opens the segments of log <server_id>: reads the footers of the sealed ones and
+// finds the end of the records in the active one. a pre-segment log (<me>_server<N>.log) becomes segment 0
+static void load_log_segments(u_int32_t server_id, u_int32_t first, u_int32_t last, int found)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    logSegmentFooter *footer;
+    char filename[40], legacy_filename[30];
+    char zeros[LOG_RECORD_MAX_SIZE];
+    u_int32_t segment;
+    u_int64_t end;
+    struct stat st;
+    s->fd = -1;
+    s->spare_fd = -1;
+    sprintf(legacy_filename, "%d_server%d.log", log_files_owner, server_id);
+    if(!found && stat(legacy_filename, &st) == 0)
+    {
+        get_log_segment_name(server_id, 0, filename);
+        log_info("migrating log %s to segment %s", legacy_filename, filename);
+        if(rename(legacy_filename, filename) == 0)
+        {
+            first = last = 0;
+            found = 1;
+        }
+    }
+    if(!found)
+    {
+        s->first_segment = 0;
+        open_log_segment(server_id, 0);
+        return;
+    }
+    s->first_segment = first;
+    for(segment = first; segment <= last; segment++)
+    {
+        s->active_segment = segment;
+        footer = add_log_segment_footer(server_id);
+        if(read_log_segment_footer(server_id, segment, footer))
+            continue;
+        memset(footer, 0, sizeof(logSegmentFooter));
+        scan_log_segment(server_id, segment, 0, footer, 0);
+        if(segment < last)
+        {
+            // a sealed segment lost its footer, seal it again
+            log_error("log segment %u of server %d has no footer", segment, server_id);
+            get_log_segment_name(server_id, segment, filename);
+            s->fd = open(filename, O_RDWR);
+            if(s->fd >= 0)
+                seal_log_segment(server_id);
+        }
+    }
+    footer = get_log_segment_footer(server_id, last);
+    if(footer->magic == LOG_SEGMENT_MAGIC)
+    {
+        // sealed right before a crash, the next segment was never created
+        open_log_segment(server_id, last + 1);
+        return;
+    }
+    get_log_segment_name(server_id, last, filename);
+    s->fd = open(filename, O_RDWR);
+    if(s->fd < 0)
+    {
+        log_error("could not open log segment %s: %s", filename, strerror(errno));
+        return;
+    }
+    end = footer->data_size;
+    log_sizes[server_id - 1] = end;
+    fstat(s->fd, &st);
+    if(st.st_size > LOG_SEGMENT_SIZE && ftruncate(s->fd, end) == 0)   // a migrated log, seal it at its end
+        st.st_size = end;
+    preallocate_log_segment(s->fd);
+    // clear a torn record at the end, so the next appends are not followed by its leftovers
+    memset(zeros, 0, sizeof(zeros));
+    if(end < (u_int64_t) st.st_size)
+        pwrite_fully(s->fd, zeros, (u_int64_t) st.st_size - end < sizeof(zeros) ? (u_int64_t) st.st_size - end : sizeof(zeros), end);
+}
+
+void create_log_files(u_int32_t me, u_int32_t num_of_servers, int recreate, int *fds)
+{
+    int i;
+    char filename[40];
+    u_int32_t owner, server_id, segment;
+    char suffix[4];
+    DIR *directory;
+    struct dirent *file;
+    u_int32_t first[num_of_servers], last[num_of_servers];
+    int found[num_of_servers];
+    log_segments = (logSegments *) calloc(num_of_servers, sizeof(logSegments));
+    log_indexes = (logIndex *) calloc(num_of_servers, sizeof(logIndex));
+    log_sizes = (u_int64_t *) calloc(num_of_servers, sizeof(u_int64_t));
+    pending_appends = (pendingAppends *) calloc(num_of_servers, sizeof(pendingAppends));
+    log_files_owner = me;
+    num_of_log_files = num_of_servers;
+    memset(found, 0, sizeof(found));
+
+    directory = opendir(".");
+    while (directory != NULL && (file = readdir(directory)) != NULL)
+    {
+        if(sscanf(file->d_name, "%u_server%u.%u.%3s", &owner, &server_id, &segment, suffix) != 4
+            || owner != me || server_id < 1 || server_id > num_of_servers)
+            continue;
+        if(!strcmp(suffix, "new"))
+        {
+            unlink(file->d_name);   // a spare segment that was never used
+            continue;
+        }
+        if(strcmp(suffix, "log"))
+            continue;
+        if(recreate)
+        {
+            unlink(file->d_name);
+            continue;
+        }
+        i = server_id - 1;
+        if(!found[i] || segment < first[i])
+            first[i] = segment;
+        if(!found[i] || segment > last[i])
+            last[i] = segment;
+        found[i] = 1;
+    }
+    if(directory != NULL)
+        closedir(directory);
+
+    for(i = 1; i <= num_of_servers;i++)
+    {
+        if(recreate)
+        {
+            sprintf(filename, "%d_server%d.log", me, i);
+            unlink(filename);
+        }
+        log_info("opening log segments of server %d", i);
+        load_log_segments(i, first[i-1], last[i-1], found[i-1]);
+        if(fds)
+            fds[i-1] = log_segments[i-1].fd;
+        sprintf(filename, "%d_server%d.idx", me, i);
+        load_log_index(i, filename, recreate);
+    }
+
+}
+
+// segments <first>... of a log deleted on the disk thread
+typedef struct {
+    u_int32_t server_id;
+    u_int32_t first;
+    u_int32_t num_of_segments;
+} logSegmentRetire;
+
+static void delete_log_segments(void *arg)  // disk thread
+{
+    logSegmentRetire *r = (logSegmentRetire *) arg;
+    char filename[40];
+    u_int32_t i;
+    for(i = 0; i < r->num_of_segments; i++)
+    {
+        get_log_segment_name(r->server_id, r->first + i, filename);
+        if(unlink(filename) < 0)
+            log_error("could not delete log segment %s: %s", filename, strerror(errno));
+    }
+}
+
+// deletes the sealed segments of log <server_id> that only hold records up to <lamport_counter>.
+// segments are retired oldest first and the active segment is never retired.
+// the files are deleted on the disk thread, behind the reads that were queued on them
+void retire_log_segments(u_int32_t server_id, u_int32_t lamport_counter)
+{
+    logSegments *s = &log_segments[server_id - 1];
+    logIndex *idx = &log_indexes[server_id - 1];
+    logSegmentRetire *r;
+    u_int32_t retired = 0, i = 0;
+    while (s->first_segment + retired < s->active_segment && s->footers[retired].last_lamport_counter <= lamport_counter)
+        retired++;
+    if(retired == 0)
+        return;
+    log_info("retiring segments %u - %u of log %d", s->first_segment, s->first_segment + retired - 1, server_id);
+    r = (logSegmentRetire *) malloc(sizeof(logSegmentRetire));
+    r->server_id = server_id;
+    r->first = s->first_segment;
+    r->num_of_segments = retired;
+    submit_disk_job(delete_log_segments, free, r);
+    s->first_segment += retired;
+    memmove(s->footers, s->footers + retired, (s->active_segment - s->first_segment + 1) * sizeof(logSegmentFooter));
+    while (i < idx->num_of_entries && idx->entries[i].segment < s->first_segment)
+        i++;
+    idx->num_of_entries -= i;
+    memmove(idx->entries, idx->entries + i, idx->num_of_entries * sizeof(logIndexEntry));
+    rewrite_log_index(server_id);
+}
+
+static void unlink_chatroom_file(chatroomFile *cf)
+{
+    if(cf->prev)
+        cf->prev->next = cf->next;
+    else
+        chatroom_files_mru = cf->next;
+    if(cf->next)
+        cf->next->prev = cf->prev;
+    else
+        chatroom_files_lru = cf->prev;
+    cf->prev = cf->next = NULL;
+}
+
+static void push_chatroom_file(chatroomFile *cf)
+{
+    cf->prev = NULL;
+    cf->next = chatroom_files_mru;
+    if(chatroom_files_mru)
+        chatroom_files_mru->prev = cf;
+    chatroom_files_mru = cf;
+    if(!chatroom_files_lru)
+        chatroom_files_lru = cf;
+}
+
+// brings the line index of a chatroom archive up to date (disk thread).
+// the lines after the last indexed one are scanned and indexed, which also builds the index of archives written before it existed
+static void sync_chatroom_index(chatroomArchive *a)
+{
+    struct stat st;
+    u_int64_t start = 0, offset;
+    char *contents;
+    ssize_t length, i;
+    fstat(a->index_fd, &st);
+    a->num_of_records = st.st_size / sizeof(u_int64_t);
+    fstat(a->fd, &st);
+    a->size = st.st_size;
+    while (a->num_of_records && (read_fully(a->index_fd, (char *) &start, sizeof(start), (a->num_of_records - 1) * sizeof(u_int64_t)) != sizeof(start) || start >= a->size))
+        a->num_of_records--;   // entries of lines that never made it to the archive
+    if(ftruncate(a->index_fd, a->num_of_records * sizeof(u_int64_t)) < 0)
+        log_error("could not truncate chatroom index of %s", a->filename);
+    if(a->num_of_records == 0)
+        start = 0;
+    if(start >= a->size)
+        return;
+    contents = (char *) malloc(a->size - start);
+    length = read_fully(a->fd, contents, a->size - start, start);
+    for(i = 0; i < length; i++)
+    {
+        // a line starts at <start> and after every newline that is not the last byte
+        if((i == 0 && a->num_of_records == 0) || (i > 0 && contents[i - 1] == '\n'))
+        {
+            offset = start + i;
+            write_fully(a->index_fd, (char *) &offset, sizeof(offset));
+            a->num_of_records++;
+        }
+    }
+    free(contents);
+}
+
+static void close_chatroom_archive(chatroomArchive *a)
+{
+    if(a->fd >= 0)
+        close(a->fd);
+    if(a->index_fd >= 0)
+        close(a->index_fd);
+    if(a->likes_fd >= 0)
+        close(a->likes_fd);
+    if(a->likes_index_fd >= 0)
+        close(a->likes_index_fd);
+    a->fd = a->index_fd = a->likes_fd = a->likes_index_fd = -1;
+}
+
+// opens (and creates) the files of a chatroom archive and reads their sizes (disk thread).
+// queued ahead of the other jobs of the chatroom file, and behind the close of an earlier one of the same chatroom,
+// so the sizes include every write queued before
+static void open_chatroom_archive(void *arg)
+{
+    chatroomArchive *a = (chatroomArchive *) arg;
+    char index_filename[60], likes_filename[60], likes_index_filename[70];
+    struct stat st;
+    sprintf(index_filename, "%s.idx", a->filename);
+    sprintf(likes_filename, "%s.likes", a->filename);
+    sprintf(likes_index_filename, "%s.idx", likes_filename);
+    a->fd = open(a->filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    a->index_fd = open(index_filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    a->likes_fd = open(likes_filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    a->likes_index_fd = open(likes_index_filename, O_RDWR | O_CREAT, 0644);   // written at the slot of each line
+    if(a->fd < 0 || a->index_fd < 0 || a->likes_fd < 0 || a->likes_index_fd < 0)
+    {
+        log_error("could not open chatroom file %s: %s", a->filename, strerror(errno));
+        close_chatroom_archive(a);
+        return;
+    }
+    a->likes_size = fstat(a->likes_fd, &st) == 0 ? st.st_size : 0;
+    sync_chatroom_index(a);
+}
+
+static void close_chatroom_archive_job(void *arg)  // disk thread
+{
+    close_chatroom_archive((chatroomArchive *) arg);
+}
+
+static void truncate_chatroom_archive(void *arg)  // disk thread
+{
+    chatroomArchive *a = (chatroomArchive *) arg;
+    if(a->fd < 0)
+        return;
+    if(ftruncate(a->fd, 0) < 0 || ftruncate(a->index_fd, 0) < 0 || ftruncate(a->likes_fd, 0) < 0 || ftruncate(a->likes_index_fd, 0) < 0)
+        log_error("could not truncate chatroom file %s", a->filename);
+    a->num_of_records = 0;
+    a->size = 0;
+    a->likes_size = 0;
+}
+
+// returns the chatroom file of <chatroom> from the LRU cache, queueing its open if needed.
+// when the cache is full, the close of the least recently used chatroom file is queued
+static chatroomFile *get_chatroom_file(u_int32_t me, char *chatroom)
+{
+    chatroomFile *cf;
+    for(cf = chatroom_files_mru; cf != NULL; cf = cf->next)
+    {
+        if(!strcmp(cf->chatroom, chatroom))
+        {
+            if(cf != chatroom_files_mru)
+            {
+                unlink_chatroom_file(cf);
+                push_chatroom_file(cf);
+            }
+            return cf;
+        }
+    }
+    if(num_of_chatroom_files < CHATROOM_FILE_CACHE_SIZE)
+        cf = &chatroom_files[num_of_chatroom_files++];
+    else
+    {
+        cf = chatroom_files_lru;
+        log_debug("closing cold chatroom file of %s", cf->chatroom);
+        unlink_chatroom_file(cf);
+        // closed behind the queued jobs that still use it
+        submit_disk_job(close_chatroom_archive_job, free, cf->archive);
+    }
+    strncpy(cf->chatroom, chatroom, sizeof(cf->chatroom) - 1);
+    cf->chatroom[sizeof(cf->chatroom) - 1] = 0;
+    cf->archive = (chatroomArchive *) calloc(1, sizeof(chatroomArchive));
+    get_chatroom_file_name(me, chatroom, cf->archive->filename);
+    submit_disk_job(open_chatroom_archive, NULL, cf->archive);
+    push_chatroom_file(cf);
+    return cf;
+}
+
+void close_chatroom_files()
+{
+    chatroomFile *cf;
+    wait_disk_writes();
+    for(cf = chatroom_files_mru; cf != NULL; cf = cf->next)
+    {
+        close_chatroom_archive(cf->archive);
+        free(cf->archive);
+    }
+    chatroom_files_mru = chatroom_files_lru = NULL;
+    num_of_chatroom_files = 0;
+}
+
+void create_chatroom_file(u_int32_t me, char *chatroom_name, int recreate)
+{
+    chatroomFile *cf = get_chatroom_file(me, chatroom_name);
+    log_info("creating/opening chatroom file for %s", chatroom_name);
+    // truncated on the disk thread, after the queued writes to the files
+    if(recreate)
+        submit_disk_job(truncate_chatroom_archive, NULL, cf->archive);
+}
+
+typedef struct {
+    u_int32_t me;
+    char (*filenames)[MAXNAMLEN + 1];
+    chatroomArchiveInfo *infos;
+} archiveScan;
+
+// parses one chatroom archive for the LTS of every line and the highest archived lamport counter of each server.
+// runs on the recovery threads, so it reads the file directly instead of going through the chatroom file cache
+static void scan_chatroom_archive(u_int32_t job, void *arg)
+{
+    archiveScan *scan = (archiveScan *) arg;
+    chatroomArchiveInfo *info = &scan->infos[job];
+    char *contents, *line, *end;
+    u_int32_t server_id, lamport_counter, capacity = 0;
+    struct stat st;
+    ssize_t length;
+    int fd = open(scan->filenames[job], O_RDONLY);
+    if(fd < 0)
+        return;
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    contents = (char *) malloc(st.st_size + 1);
+    length = read_fully(fd, contents, st.st_size, 0);
+    close(fd);
+    contents[length] = 0;
+    for(line = contents; line < contents + length; line = end + 1)
+    {
+        if(info->num_of_messages == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            info->messages = (archivedMessage *) realloc(info->messages, capacity * sizeof(archivedMessage));
+        }
+        // lines start with <server id>~<lamport counter>~
+        server_id = strtoul(line, &end, 10);
+        lamport_counter = 0;
+        if(*end == '~')
+        {
+            lamport_counter = strtoul(end + 1, &end, 10);
+            if(server_id >= 1 && server_id <= NUM_SERVERS && lamport_counter > info->last_lamport_counters[server_id - 1])
+                info->last_lamport_counters[server_id - 1] = lamport_counter;
+        }
+        // every line gets an entry, so entries line up with the line numbers of the archive
+        info->messages[info->num_of_messages].serverID = server_id;
+        info->messages[info->num_of_messages].lamportCounter = lamport_counter;
+        info->num_of_messages++;
+        end = strchr(end, '\n');
+        if(end == NULL)
+            break;
+    }
+    free(contents);
+}
+
+static int compare_archive_names(const void *a, const void *b)
+{
+    return strcmp(((chatroomArchiveInfo *) a)->chatroom, ((chatroomArchiveInfo *) b)->chatroom);
 }
 
-void create_log_files(u_int32_t me, u_int32_t num_of_servers, int recreate, int *fds)
+// finds the chatroom archives of server <me> in the base directory and scans them on <num_threads> threads.
+// returns a malloc'ed array of <num_of_archives> results sorted by chatroom name, so the caller can apply them deterministically
+chatroomArchiveInfo *scan_chatroom_archives(u_int32_t me, int num_threads, u_int32_t *num_of_archives)
+{
+    DIR *directory;
+    struct dirent *file;
+    archiveScan scan;
+    u_int32_t capacity = 0, server_id;
+    char chatroom[20], *dot;
+    *num_of_archives = 0;
+    scan.me = me;
+    scan.filenames = NULL;
+    scan.infos = NULL;
+    directory = opendir(".");
+    if (directory == NULL) {
+        log_error("error opening base directory");
+        return NULL;
+    }
+    while ((file = readdir(directory)) != NULL)
+    {
+        dot = strrchr(file->d_name, '.');
+        if(dot == NULL || dot == file->d_name || strcmp(dot + 1, "chatroom"))
+            continue;
+        if(sscanf(file->d_name, "%u_%19[^.].chatroom", &server_id, chatroom) != 2 || server_id != me)
+            continue;
+        if(*num_of_archives == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            scan.filenames = realloc(scan.filenames, capacity * sizeof(*scan.filenames));
+            scan.infos = (chatroomArchiveInfo *) realloc(scan.infos, capacity * sizeof(chatroomArchiveInfo));
+        }
+        strcpy(scan.filenames[*num_of_archives], file->d_name);
+        memset(&scan.infos[*num_of_archives], 0, sizeof(chatroomArchiveInfo));
+        strcpy(scan.infos[*num_of_archives].chatroom, chatroom);
+        (*num_of_archives)++;
+    }
+    closedir(directory);
+    log_info("scanning %d chatroom files on %d threads", *num_of_archives, num_threads);
+    run_parallel(num_threads, *num_of_archives, scan_chatroom_archive, &scan);
+    free(scan.filenames);
+    if(*num_of_archives)
+        qsort(scan.infos, *num_of_archives, sizeof(chatroomArchiveInfo), compare_archive_names);
+    return scan.infos;
+}
+
+typedef struct {
+    u_int32_t me;
+    char *buffer;
+    u_int32_t size;
+    int *written;
+    diskCallback done;
+    void *arg;
+} snapshotWrite;
+
+static void write_snapshot_job(void *arg)  // disk thread
+{
+    snapshotWrite *w = (snapshotWrite *) arg;
+    char filename[30], tmp_filename[40];
+    int fd;
+    *w->written = 0;
+    sprintf(filename, "%d.snapshot", w->me);
+    sprintf(tmp_filename, "%s.tmp", filename);
+    fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        log_error("could not create snapshot file %s: %s", tmp_filename, strerror(errno));
+        return;
+    }
+    if(write_fully(fd, w->buffer, w->size) < 0 || fdatasync(fd) < 0)
+    {
+        close(fd);
+        unlink(tmp_filename);
+        return;
+    }
+    close(fd);
+    if(rename(tmp_filename, filename) < 0)
+    {
+        log_error("could not install snapshot file %s: %s", filename, strerror(errno));
+        return;
+    }
+    *w->written = 1;
+}
+
+static void finish_snapshot_write(void *arg)
+{
+    snapshotWrite *w = (snapshotWrite *) arg;
+    w->done(w->arg);
+    free(w->buffer);
+    free(w);
+}
+
+// atomically replaces the snapshot file of server <me> with <buffer>, which is handed over and freed:
+// the snapshot is written and synced to <me>.snapshot.tmp, then renamed over <me>.snapshot.
+// this runs on the disk thread behind the queued writes, so the snapshot never gets ahead of the archives it relies on.
+// <done> is called on the event loop thread afterwards, with <written> set to 1 if the snapshot was installed
+void write_snapshot_file(u_int32_t me, char *buffer, u_int32_t size, int *written, diskCallback done, void *arg)
+{
+    snapshotWrite *w = (snapshotWrite *) malloc(sizeof(snapshotWrite));
+    w->me = me;
+    w->buffer = buffer;
+    w->size = size;
+    w->written = written;
+    w->done = done;
+    w->arg = arg;
+    submit_disk_job(write_snapshot_job, finish_snapshot_write, w);
+}
+
+// reads the snapshot file of server <me>. returns a malloc'ed buffer, or NULL if there is no snapshot
+char *read_snapshot_file(u_int32_t me, u_int32_t *size)
+{
+    char filename[30];
+    char *buffer;
+    struct stat st;
+    int fd;
+    sprintf(filename, "%d.snapshot", me);
+    fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    buffer = (char *) malloc(st.st_size);
+    *size = read_fully(fd, buffer, st.st_size, 0);
+    close(fd);
+    return buffer;
+}
+
+// serializes <e> into <buffer> as a binary log record
+// <buffer> must hold at least LOG_RECORD_MAX_SIZE bytes. returns the record length
+u_int32_t encode_log_record(logEvent *e, char *buffer)
+{
+    unsigned char chatroom_length = strnlen(e->chatroom, sizeof(e->chatroom));
+    buffer[0] = (char) LOG_RECORD_MAGIC;
+    buffer[1] = e->eventType;
+    buffer[2] = chatroom_length;
+    buffer[3] = LOG_PAYLOAD_FIELDS;
+    memcpy(buffer + 4, &e->lamportCounter, 4);
+    memcpy(buffer + 8, &e->payload_length, 4);
+    memcpy(buffer + LOG_RECORD_HEADER_SIZE, e->chatroom, chatroom_length);
+    memcpy(buffer + LOG_RECORD_HEADER_SIZE + chatroom_length, e->payload, e->payload_length);
+    return LOG_RECORD_HEADER_SIZE + chatroom_length + e->payload_length;
+}
+
+// converts the "~" separated text payload of an old record (or legacy line) <text> of <e> to the encoded fields.
+// a payload that does not parse is dropped (left empty), so the event is rejected when it is processed
+static void convert_text_payload(logEvent *e, const char *text)
+{
+    char username[20], message[80];
+    u_int32_t pid, counter;
+    e->payload_length = 0;
+    if(e->eventType == TYPE_APPEND)
+    {
+        message[0] = 0;
+        if(sscanf(text, "%19[^\n\t~]~%79[^\n\t]", username, message) >= 1)
+            set_append_payload(e, username, message, strlen(message));
+    }
+    else if(e->eventType == TYPE_LIKE || e->eventType == TYPE_UNLIKE)
+    {
+        if(sscanf(text, "%19[^~]~%u~%u", username, &pid, &counter) == 3)
+            set_like_payload(e, username, pid, counter);
+    }
+    if(e->payload_length == 0)
+        log_error("dropping the malformed text payload of log record %u", e->lamportCounter);
+}
+
+// deserializes one binary log record from <buffer> into <e>
+// returns the number of bytes consumed, 0 if <buffer> holds less than a full record, -1 if it is not a valid record
+int decode_log_record(const char *buffer, u_int32_t size, logEvent *e)
+{
+    char text[sizeof(e->payload) + 1];
+    u_int32_t payload_length;
+    unsigned char chatroom_length;
+    if(size < LOG_RECORD_HEADER_SIZE)
+        return 0;
+    if((unsigned char) buffer[0] != LOG_RECORD_MAGIC)
+        return -1;
+    chatroom_length = buffer[2];
+    memcpy(&payload_length, buffer + 8, 4);
+    if(chatroom_length >= sizeof(e->chatroom) || payload_length > sizeof(e->payload))
+        return -1;
+    if(size < LOG_RECORD_HEADER_SIZE + chatroom_length + payload_length)
+        return 0;
+    memset(e, 0, sizeof(logEvent));
+    e->eventType = buffer[1];
+    memcpy(&e->lamportCounter, buffer + 4, 4);
+    memcpy(e->chatroom, buffer + LOG_RECORD_HEADER_SIZE, chatroom_length);
+    if(buffer[3] == LOG_PAYLOAD_TEXT)
+    {
+        memcpy(text, buffer + LOG_RECORD_HEADER_SIZE + chatroom_length, payload_length);
+        text[payload_length] = 0;
+        convert_text_payload(e, text);
+    }
+    else
+    {
+        e->payload_length = payload_length;
+        memcpy(e->payload, buffer + LOG_RECORD_HEADER_SIZE + chatroom_length, payload_length);
+    }
+    return LOG_RECORD_HEADER_SIZE + chatroom_length + payload_length;
+}
+
+// writes the fields of an append of <message> (<message_length> bytes) by <username> to the payload of <e>
+void set_append_payload(logEvent *e, const char *username, const char *message, u_int32_t message_length)
+{
+    wireWriter w;
+    wire_writer_init_buffer(&w, e->payload, sizeof(e->payload));
+    wire_write_string(&w, username, strlen(username));
+    wire_write_string(&w, message, message_length);
+    e->payload_length = wire_size(&w);
+}
+
+// writes the fields of a like/unlike by <username> of message <pid>, <counter> to the payload of <e>
+void set_like_payload(logEvent *e, const char *username, u_int32_t pid, u_int32_t counter)
+{
+    wireWriter w;
+    wire_writer_init_buffer(&w, e->payload, sizeof(e->payload));
+    wire_write_string(&w, username, strlen(username));
+    wire_write_u32(&w, pid);
+    wire_write_u32(&w, counter);
+    e->payload_length = wire_size(&w);
+}
+
+// reads the fields of the append <e>: <username> (20 bytes) and <message> (80 bytes, not terminated)
+// returns 0 if the payload is malformed or a field does not fit
+int get_append_payload(const logEvent *e, char *username, char *message, u_int32_t *message_length)
+{
+    wireReader r;
+    wireString text;
+    wire_reader_init(&r, e->payload, e->payload_length);
+    if(!wire_string_copy(wire_read_string(&r), username, 20) || username[0] == 0)
+        return 0;
+    text = wire_read_string(&r);
+    if(!wire_reader_ok(&r) || wire_remaining(&r) != 0 || text.length > 80)
+        return 0;
+    memcpy(message, text.data, text.length);
+    *message_length = text.length;
+    return 1;
+}
+
+// reads the fields of the like/unlike <e>: <username> (20 bytes) and the message <pid>, <counter>
+// returns 0 if the payload is malformed
+int get_like_payload(const logEvent *e, char *username, u_int32_t *pid, u_int32_t *counter)
+{
+    wireReader r;
+    wire_reader_init(&r, e->payload, e->payload_length);
+    if(!wire_string_copy(wire_read_string(&r), username, 20) || username[0] == 0)
+        return 0;
+    *pid = wire_read_u32(&r);
+    *counter = wire_read_u32(&r);
+    return wire_reader_ok(&r) && wire_remaining(&r) == 0;
+}
+
+// reads the next record from the current position of log file <f>
+// binary records are read directly; legacy text lines are still parsed with parseLineInLogFile
+// returns 1 if a record was read into <e>, 0 on end of file (or a torn record at the end)
+int read_log_record(FILE *f, logEvent *e)
+{
+    char record[LOG_RECORD_MAX_SIZE];
+    char *line = NULL;
+    size_t len = 0;
+    u_int32_t body_length, payload_length;
+    int c;
+    while ((c = fgetc(f)) != EOF)
+    {
+        if(c == 0)      // unwritten space of a preallocated segment, or the footer of a sealed one
+            return 0;
+        if(c == '\n')     // empty line between legacy records
+            continue;
+        if(c == LOG_RECORD_MAGIC)
+        {
+            record[0] = c;
+            if(fread(record + 1, 1, LOG_RECORD_HEADER_SIZE - 1, f) != LOG_RECORD_HEADER_SIZE - 1)
+                return 0;
+            memcpy(&payload_length, record + 8, 4);
+            body_length = (unsigned char) record[2] + payload_length;
+            if(body_length > LOG_RECORD_MAX_SIZE - LOG_RECORD_HEADER_SIZE)
+            {
+                log_error("corrupt log record with body length %u", body_length);
+                return 0;
+            }
+            if(fread(record + LOG_RECORD_HEADER_SIZE, 1, body_length, f) != body_length)
+                return 0;
+            return decode_log_record(record, LOG_RECORD_HEADER_SIZE + body_length, e) > 0;
+        }
+        ungetc(c, f);
+        if(getline(&line, &len, f) == -1)
+            break;
+        if(strlen(line) < 2)
+            continue;
+        memset(e, 0, sizeof(logEvent));
+        parseLineInLogFile(line, e);
+        free(line);
+        return 1;
+    }
+    free(line);
+    return 0;
+}
+
+void set_log_durability(enum LogDurability mode, u_int32_t group_records, u_int32_t group_usec)
+{
+    flush_log_files();
+    log_durability = mode;
+    if(group_records)
+        group_commit_records = group_records;
+    if(group_usec)
+        group_commit_usec = group_usec;
+    log_info("log durability mode %d, group commit every %u records or %u usec", mode, group_commit_records, group_commit_usec);
+}
+
+static void record_commit(u_int32_t records, u_int32_t bytes, u_int64_t latency)
+{
+    commit_stats.commits++;
+    commit_stats.records += records;
+    commit_stats.bytes += bytes;
+    commit_stats.total_latency_usec += latency;
+    if(latency > commit_stats.max_latency_usec)
+        commit_stats.max_latency_usec = latency;
+    if(records > commit_stats.max_batch)
+        commit_stats.max_batch = records;
+    log_debug("log commit of %u records (%u bytes) took %llu usec", records, bytes, (unsigned long long) latency);
+    if(commit_stats.commits % LOG_COMMIT_STATS_INTERVAL == 0)
+        log_info("log commits: %llu, avg batch %.1f records, max batch %u, avg latency %llu usec, max latency %llu usec",
+            (unsigned long long) commit_stats.commits, (double) commit_stats.records / commit_stats.commits, commit_stats.max_batch,
+            (unsigned long long) (commit_stats.total_latency_usec / commit_stats.commits), (unsigned long long) commit_stats.max_latency_usec);
+}
+
+// writes the buffers of a commit and syncs the written files (disk thread)
+static void write_log_commit(void *arg)
 {
+    logCommit *commit = (logCommit *) arg;
+    struct timeval start;
     int i;
-    char filename[20];
-    log_files = (FILE **) malloc(num_of_servers * sizeof(FILE *));
+    gettimeofday(&start, NULL);
+    for(i = 0; i < commit->num_of_writes; i++)
+        pwrite_fully(commit->writes[i].fd, commit->writes[i].buffer, commit->writes[i].length, commit->writes[i].offset);
+    for(i = 0; commit->sync && i < commit->num_of_writes; i++)
+        fdatasync(commit->writes[i].fd);
+    commit->latency_usec = elapsed_usec(&start);
+}
 
-    for(i = 1; i <= num_of_servers;i++)
+// the records of a commit reached the disk: update the statistics and run the callbacks waiting for them
+static void finish_log_commit(void *arg)
+{
+    logCommit *commit = (logCommit *) arg;
+    logCommitCallback *callback, *next;
+    int i;
+    record_commit(commit->records, commit->bytes, commit->latency_usec);
+    for(callback = commit->callbacks; callback != NULL; callback = next)
     {
-        sprintf(filename, "%d_server%d.log", me, i);
-        log_info("creating/opening file %s", filename);
-        if(recreate)
-        	log_files[i-1] = fopen(filename, "w+");
-        else
-        	log_files[i-1] = fopen(filename, "a+");
+        next = callback->next;
+        callback->done(callback->arg);
+        free(callback);
     }
+    for(i = 0; i < commit->num_of_writes; i++)
+        free(commit->writes[i].buffer);
+    free(commit);
+}
 
+static logCommit *new_log_commit(int sync)
+{
+    logCommit *commit = (logCommit *) calloc(1, sizeof(logCommit) + num_of_log_files * sizeof(logWrite));
+    commit->writes = (logWrite *) (commit + 1);
+    commit->sync = sync;
+    return commit;
 }
 
-void create_chatroom_file(u_int32_t me, char *chatroom_name, int recreate)
+// commits the pending appends of every log file: one write per file, then one fdatasync per written file.
+// the commit runs on the disk thread; the buffers are handed over to it
+void flush_log_files()
 {
-    FILE *f;
-    u_int32_t size = 15 + strlen(chatroom_name);
-    char filename[size];
-    sprintf(filename, "%d_%s.chatroom", me, chatroom_name);
-    log_info("creating/opening file %s", filename);
-    if(recreate)
-    	f = fopen(filename, "w+");
+    int i;
+    logCommit *commit;
+    if(pending_records == 0)
+        return;
+    commit = new_log_commit(log_durability == LOG_DURABILITY_GROUP);
+    for(i = 0; i < num_of_log_files; i++)
+    {
+        pendingAppends *p = &pending_appends[i];
+        if(p->records == 0)
+            continue;
+        commit->writes[commit->num_of_writes].fd = log_segments[i].fd;
+        commit->writes[commit->num_of_writes].buffer = p->buffer;
+        commit->writes[commit->num_of_writes].length = p->length;
+        commit->writes[commit->num_of_writes].offset = log_sizes[i] - p->length;
+        commit->num_of_writes++;
+        commit->records += p->records;
+        commit->bytes += p->length;
+        p->buffer = NULL;
+        p->capacity = 0;
+        p->length = 0;
+        p->records = 0;
+    }
+    commit->callbacks = pending_callbacks;
+    pending_callbacks = pending_callbacks_tail = NULL;
+    pending_records = 0;
+    submit_disk_job(write_log_commit, finish_log_commit, commit);
+}
+
+// calls <done> on the event loop thread once every record appended so far is committed
+void after_log_commit(diskCallback done, void *arg)
+{
+    logCommitCallback *callback;
+    if(pending_records == 0)
+    {
+        // earlier commits are queued already, and the disk thread finishes jobs in order
+        submit_disk_job(NULL, done, arg);
+        return;
+    }
+    callback = (logCommitCallback *) malloc(sizeof(logCommitCallback));
+    callback->done = done;
+    callback->arg = arg;
+    callback->next = NULL;
+    if(pending_callbacks_tail)
+        pending_callbacks_tail->next = callback;
     else
-    	f = fopen(filename, "a+");
-    fclose(f);
+        pending_callbacks = callback;
+    pending_callbacks_tail = callback;
+}
+
+void get_log_commit_stats(logCommitStats *stats)
+{
+    *stats = commit_stats;
 }
 
-void addEventToLogFile(u_int32_t server_id, char *line)
+void addEventToLogFile(u_int32_t server_id, logEvent *e)
 {
-    FILE * f = log_files[server_id - 1];
-    log_info("writing to file %s", line);
-    fwrite(line, 1, strlen(line), f);
-    fflush(f);
+    pendingAppends *p = &pending_appends[server_id - 1];
+    logSegments *segments = &log_segments[server_id - 1];
+    char record[LOG_RECORD_MAX_SIZE];
+    u_int32_t length = encode_log_record(e, record);
+    logCommit *commit;
+    log_info("writing to log file of server %d: lc = %u, type = %c, chatroom = %s", server_id, e->lamportCounter, e->eventType, e->chatroom);
+    if(log_sizes[server_id - 1] + length > LOG_SEGMENT_SIZE - sizeof(logSegmentFooter))
+    {
+        // the record does not fit in front of the footer, move on to a new segment.
+        // the seal is queued behind the commit of the segment's last records
+        flush_log_files();
+        seal_log_segment(server_id);
+        open_log_segment(server_id, segments->active_segment + 1);
+    }
+    index_log_record(server_id, e->lamportCounter, segments->active_segment, log_sizes[server_id - 1]);
+    log_sizes[server_id - 1] += length;
+    if(log_sizes[server_id - 1] > LOG_SEGMENT_SIZE / 2 && segments->spare_fd < 0 && !segments->creating_spare)
+        prepare_log_segment(server_id);
+    account_log_segment_record(get_log_segment_footer(server_id, segments->active_segment), e->lamportCounter, log_sizes[server_id - 1]);
+    if(log_durability != LOG_DURABILITY_GROUP)
+    {
+        commit = new_log_commit(log_durability == LOG_DURABILITY_FSYNC);
+        commit->writes[0].fd = segments->fd;
+        commit->writes[0].buffer = (char *) malloc(length);
+        memcpy(commit->writes[0].buffer, record, length);
+        commit->writes[0].length = length;
+        commit->writes[0].offset = log_sizes[server_id - 1] - length;
+        commit->num_of_writes = 1;
+        commit->records = 1;
+        commit->bytes = length;
+        submit_disk_job(write_log_commit, finish_log_commit, commit);
+        return;
+    }
+    if(p->length + length > p->capacity)
+    {
+        p->capacity = p->capacity ? p->capacity * 2 : 16 * LOG_RECORD_MAX_SIZE;
+        p->buffer = (char *) realloc(p->buffer, p->capacity);
+    }
+    memcpy(p->buffer + p->length, record, length);
+    p->length += length;
+    p->records++;
+    if(pending_records++ == 0)
+        gettimeofday(&oldest_pending, NULL);
+    if(pending_records >= group_commit_records || elapsed_usec(&oldest_pending) >= group_commit_usec)
+        flush_log_files();
 }
 
 void parseLineInLogFile(char *line, logEvent *e)
 {
+    char text[sizeof(e->payload)];
     log_debug("line is %s", line);
-    sscanf(line, "%d~%[^\t\n~]~%c~%[^\n\t]", &e->lamportCounter, e->chatroom,  &e->eventType, e->payload);
-    log_debug("%d, %s, %c, %s", e->lamportCounter, e->chatroom,  e->eventType, e->payload);
+    text[0] = 0;
+    sscanf(line, "%u~%19[^\t\n~]~%c~%111[^\n\t]", &e->lamportCounter, e->chatroom,  &e->eventType, text);
+    log_debug("%d, %s, %c, %s", e->lamportCounter, e->chatroom,  e->eventType, text);
+    convert_text_payload(e, text);
+}
+
+// appends the line of a message and its index entry to a chatroom archive (disk thread)
+static void write_chatroom_append(void *arg)
+{
+    chatroomAppend *append = (chatroomAppend *) arg;
+    chatroomArchive *a = append->archive;
+    u_int64_t offset = a->size;
+    if(a->fd < 0)
+        return;
+    a->size += append->length;
+    a->num_of_records++;
+    if(write_fully(a->fd, append->line, append->length) < 0)
+        return;
+    write_fully(a->index_fd, (char *) &offset, sizeof(offset));
 }
 
+// the line is queued for the disk thread
 void addMessageToChatroomFile(u_int32_t me, char *chatroom, Message m)
 {
     char line[400];
-    char filename[20];
-    get_chatroom_file_name(me, chatroom, filename);
-    FILE * f = fopen(filename, "a+");
-    sprintf(line, "%d~%d~%s~%s~%s\n", m.serverID, m.lamportCounter, m.userName, m.message, m.additionalInfo);
-    log_info("writing to chatroom file %s too %s", line, filename);
-    fwrite(line, 1, strlen(line), f);
-    fclose(f);
+    chatroomAppend *append;
+    u_int32_t length;
+    chatroomFile *cf = get_chatroom_file(me, chatroom);
+    if(cf == NULL)
+        return;
+    length = sprintf(line, "%d~%d~%s~%s~%s\n", m.serverID, m.lamportCounter, m.userName, m.message, m.additionalInfo);
+    log_info("writing to chatroom file of %s: %s", chatroom, line);
+    append = (chatroomAppend *) malloc(sizeof(chatroomAppend) + length);
+    append->archive = cf->archive;
+    append->length = length;
+    memcpy(append->line, line, length);
+    submit_disk_job(write_chatroom_append, free, append);
+}
+
+// appends an entry to a likes journal, chained to the newest entry of its line, and makes it the newest (disk thread)
+static void write_chatroom_like(void *arg)
+{
+    chatroomLike *like = (chatroomLike *) arg;
+    chatroomArchive *a = like->archive;
+    u_int64_t slot = (u_int64_t) like->like.line * sizeof(u_int64_t), newest = 0, offset = a->likes_size;
+    if(a->fd < 0)
+        return;
+    // a slot past the end of the likes index (or in a hole) reads as 0, the line has no entries yet
+    read_fully(a->likes_index_fd, (char *) &newest, sizeof(newest), slot);
+    like->like.previous = newest;
+    a->likes_size += sizeof(archivedLike);
+    if(write_fully(a->likes_fd, (char *) &like->like, sizeof(archivedLike)) < 0)
+        return;
+    newest = offset + 1;
+    pwrite_fully(a->likes_index_fd, (char *) &newest, sizeof(newest), slot);
+}
+
+// journals a like or unlike (<type>) by <username> of message <server_id>, <lamport_counter> on archived line <line> of <chatroom>
+void addLikeToChatroomFile(u_int32_t me, char *chatroom, u_int32_t line, u_int32_t server_id, u_int32_t lamport_counter, char type, char *username)
+{
+    chatroomLike *like;
+    chatroomFile *cf = get_chatroom_file(me, chatroom);
+    if(cf == NULL)
+        return;
+    log_info("journaling %c of archived message %u of %s by %s", type, line, chatroom, username);
+    like = (chatroomLike *) calloc(1, sizeof(chatroomLike));
+    like->archive = cf->archive;
+    like->like.line = line;
+    like->like.server_id = server_id;
+    like->like.lamport_counter = lamport_counter;
+    like->like.type = type;
+    strncpy(like->like.username, username, sizeof(like->like.username) - 1);
+    submit_disk_job(write_chatroom_like, free, like);
 }
 
 void parseLineInMessagesFile(char *line, Message *m)
@@ -69,79 +1730,500 @@ void parseLineInMessagesFile(char *line, Message *m)
     sscanf(line, "%d~%d~%[^\t\n~]~%[^\t\n~]~%s", &m->serverID, &m->lamportCounter, m->userName, m->message, m->additionalInfo);
 }
 
-void get_logs_newer_than(u_int32_t server_id, u_int32_t lamport_counter, u_int32_t *length, logEvent *logs)
+// applies a journaled like/unlike of <username> to the comma-terminated likers list of an archived message
+static void apply_archived_like(Message *m, char type, char *username)
 {
-    FILE * fp = log_files[server_id - 1];
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    logEvent e;
-    *length = 0;
-    memset(&e, 0, sizeof(e));
-    rewind(fp);
-    while ((read = getline(&line, &len, fp)) != -1) {
-        log_debug("Retrieved line of length %zu from server %d log file:\n", read, server_id);
-        log_debug("%s", line);
-        if(strlen(line) < 2)    // reached \n
-            continue;
-        parseLineInLogFile(line, &e);
-        if(e.lamportCounter > lamport_counter)
+    char *liker = m->additionalInfo, *end;
+    size_t length = strlen(username), total = strlen(m->additionalInfo);
+    for(; (end = strchr(liker, ',')) != NULL; liker = end + 1)
+    {
+        if(end - liker == length && !strncmp(liker, username, length))
         {
-            logs[*length].lamportCounter = e.lamportCounter;
-            logs[*length].eventType = e.eventType;
-            memcpy(logs[*length].payload, e.payload, 100);
-            memcpy(logs[*length].additionalInfo, e.additionalInfo, 20);
-            memcpy(logs[*length].chatroom, e.chatroom, 20);
-            (*length)++;
+            if(type == TYPE_UNLIKE)
+            {
+                memmove(liker, end + 1, strlen(end + 1) + 1);
+                m->numOfLikes--;
+            }
+            return;
         }
     }
-    fseek(fp, 0, SEEK_END);
+    if(type == TYPE_LIKE && total + length + 2 <= sizeof(m->additionalInfo))
+    {
+        sprintf(m->additionalInfo + total, "%s,", username);
+        m->numOfLikes++;
+    }
 }
 
-void retrieve_chatroom_history(u_int32_t me, char *chatroom, u_int32_t *num_of_messages, Message *messages)
+// applies the likes journal to the archived lines <lines> (ascending) held in <messages> (disk thread).
+// only the entries of these lines are read: the chain of each line is walked back from its newest entry, then applied oldest first
+static void read_chatroom_likes(chatroomHistoryRead *h, u_int32_t *lines, u_int32_t count)
 {
-    char filename[20];
-    int read;
-    char line[400];
-    u_int32_t len;
-    *num_of_messages = 0;
-    get_chatroom_file_name(me, chatroom, filename);
-    FILE *cf = fopen(filename, "r");
-	if ( cf != NULL )
-	{
-		while ((read = getline(&line, &len, cf)) != -1) {
-            if(len < 3)
+    u_int64_t *newest, next;
+    archivedLike *chain = NULL;
+    u_int32_t i, length, capacity = 0;
+    if(h->likes_size == 0 || count == 0)
+        return;
+    newest = (u_int64_t *) calloc(lines[count - 1] - lines[0] + 1, sizeof(u_int64_t));
+    read_fully(h->archive->likes_index_fd, (char *) newest, (lines[count - 1] - lines[0] + 1) * sizeof(u_int64_t), (u_int64_t) lines[0] * sizeof(u_int64_t));
+    for(i = 0; i < count; i++)
+    {
+        length = 0;
+        // entries only point back, and a chain ends at the first entry that is not all there (the journal is
+        // read as of this history request, and entries may have been lost in a crash)
+        for(next = newest[lines[i] - lines[0]]; next > 0 && next - 1 + sizeof(archivedLike) <= h->likes_size; next = chain[length - 1].previous)
+        {
+            if(length == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 16;
+                chain = (archivedLike *) realloc(chain, capacity * sizeof(archivedLike));
+            }
+            if(read_fully(h->archive->likes_fd, (char *) &chain[length], sizeof(archivedLike), next - 1) != sizeof(archivedLike)
+                || chain[length].line != lines[i] || chain[length].previous >= next)
+                break;
+            chain[length].username[sizeof(chain[length].username) - 1] = 0;
+            length++;
+        }
+        while (length > 0)
+        {
+            length--;
+            if(chain[length].server_id != h->messages[i].serverID || chain[length].lamport_counter != h->messages[i].lamportCounter)
+            {
+                log_error("%c of message %u, %u by %s is journaled for line %u, which holds message %u, %u", chain[length].type, chain[length].server_id,
+                    chain[length].lamport_counter, chain[length].username, lines[i], h->messages[i].serverID, h->messages[i].lamportCounter);
                 continue;
-			parseLineInMessagesFile(line, &messages[*num_of_messages]);
-			log_debug("LTS = %d, %d", messages[*num_of_messages].serverID, messages[*num_of_messages].lamportCounter);
-			(*num_of_messages)++;
-		}
-	}
+            }
+            apply_archived_like(&h->messages[i], chain[length].type, chain[length].username);
+        }
+    }
+    free(chain);
+    free(newest);
 }
 
-void retrieve_line_from_logs(logEvent *e, u_int32_t *available_data, u_int32_t num_servers, u_int32_t *last_processed_counters)
+// reads the tail of a chatroom archive into the messages of a history read (disk thread)
+static void read_chatroom_history(void *arg)
 {
-    FILE * fp;
-    int i;
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    logEvent parsed_e;
-    for(i = 0;i< num_servers;i++)
+    chatroomHistoryRead *h = (chatroomHistoryRead *) arg;
+    char *contents, *line, *end, *c;
+    u_int64_t start = 0;
+    u_int32_t number, lines[h->max_messages + 1];
+    ssize_t length;
+    chatroomArchive *a = h->archive;
+    if(a == NULL || a->fd < 0 || a->num_of_records == 0 || h->max_messages == 0)
+        return;
+    // the archive as it is once the jobs queued before this read are done
+    h->first = a->num_of_records > h->max_messages ? a->num_of_records - h->max_messages : 0;
+    h->size = a->size;
+    h->likes_size = a->likes_size;
+    if(read_fully(a->index_fd, (char *) &start, sizeof(start), h->first * sizeof(u_int64_t)) != sizeof(start) || start >= h->size)
+        return;
+    contents = (char *) malloc(h->size - start + 1);
+    length = read_fully(a->fd, contents, h->size - start, start);
+    contents[length] = 0;
+    for(line = contents, number = h->first; line < contents + length && *h->num_of_messages < h->max_messages; line = end + 1, number++)
+    {
+        Message *m = &h->messages[*h->num_of_messages];
+        end = strchr(line, '\n');
+        if(end == NULL)
+            end = contents + length;
+        *end = 0;
+        if(end - line < 3)
+            continue;
+        memset(m, 0, sizeof(Message));
+        parseLineInMessagesFile(line, m);
+        // additional info is the comma-terminated list of likers
+        for(c = m->additionalInfo; *c; c++)
+            if(*c == ',')
+                m->numOfLikes++;
+        lines[(*h->num_of_messages)++] = number;
+    }
+    free(contents);
+    read_chatroom_likes(h, lines, *h->num_of_messages);
+}
+
+static void finish_chatroom_history(void *arg)
+{
+    chatroomHistoryRead *h = (chatroomHistoryRead *) arg;
+    h->done(h->arg);
+    free(h);
+}
+
+// reads the last (up to) <max_messages> archived messages of <chatroom> into <messages>, oldest first,
+// then calls <done> on the event loop thread. <num_of_messages> and <messages> must stay valid until then.
+// the line index gives the offset of the first wanted line, so only the tail of the archive is read
+void retrieve_chatroom_history(u_int32_t me, char *chatroom, u_int32_t max_messages, u_int32_t *num_of_messages, Message *messages, diskCallback done, void *arg)
+{
+    chatroomHistoryRead *h = (chatroomHistoryRead *) malloc(sizeof(chatroomHistoryRead));
+    chatroomFile *cf = get_chatroom_file(me, chatroom);
+    *num_of_messages = 0;
+    h->archive = cf ? cf->archive : NULL;
+    h->num_of_messages = num_of_messages;
+    h->messages = messages;
+    h->max_messages = max_messages;
+    h->done = done;
+    h->arg = arg;
+    submit_disk_job(read_chatroom_history, finish_chatroom_history, h);
+}
+
+// opens <segment> at <offset> under the cursor
+static void open_log_cursor_segment(logCursor *c, u_int32_t segment, u_int64_t offset)
+{
+    char filename[40];
+    if(c->file)
+        fclose(c->file);
+    c->segment = segment;
+    get_log_segment_name(c->server_id, segment, filename);
+    c->file = fopen(filename, "r");
+    if(c->file == NULL)
+    {
+        log_error("could not open cursor on %s", filename);
+        return;
+    }
+    fseek(c->file, offset, SEEK_SET);
+}
+
+// reads the next record under the cursor, moving on to the next segment at the end of a segment
+static int read_log_cursor_record(logCursor *c, logEvent *e)
+{
+    while (c->file != NULL)
+    {
+        if(read_log_record(c->file, e))
+            return 1;
+        if(c->segment >= c->last_segment)
+            return 0;
+        open_log_cursor_segment(c, c->segment + 1, 0);
+    }
+    return 0;
+}
+
+// places a new cursor on log <server_id> in front of the first record newer than <lamport_counter>, without reading:
+// at the latest indexed record that is not newer than <lamport_counter>, skipping the sealed segments whose
+// footer says they only hold older records. uses the in-memory index, so it runs on the event loop thread
+static void place_log_cursor(logCursor *c, u_int32_t server_id, u_int32_t lamport_counter)
+{
+    logIndex *idx = &log_indexes[server_id - 1];
+    logSegments *s = &log_segments[server_id - 1];
+    int low = 0, high = (int) idx->num_of_entries - 1, mid, found = -1;
+    memset(c, 0, sizeof(logCursor));
+    c->server_id = server_id;
+    c->segment = s->first_segment;
+    c->last_segment = s->active_segment;
+    c->after = lamport_counter;
+    while (low <= high)
     {
-        fp = log_files[i];
-        rewind(fp);
-        available_data[i] = 0;
-        while ((read = getline(&line, &len, fp)) != -1)
+        mid = (low + high) / 2;
+        if(idx->entries[mid].lamportCounter <= lamport_counter)
         {
-            if(strlen(line) < 2)    // reached \n or empty line
-                continue;
-            parseLineInLogFile(line, &parsed_e);
-            if(parsed_e.lamportCounter > last_processed_counters[i]){
-                memcpy(&e[i], &parsed_e, sizeof(parsed_e));
-                available_data[i] = 1;
-                break;
-            }
+            found = mid;
+            low = mid + 1;
+        }
+        else
+            high = mid - 1;
+    }
+    if(found != -1)
+    {
+        c->segment = idx->entries[found].segment;
+        c->offset = idx->entries[found].offset;
+    }
+    while (c->segment < s->active_segment && get_log_segment_footer(server_id, c->segment)->last_lamport_counter <= lamport_counter)
+    {
+        c->segment++;
+        c->offset = 0;
+    }
+}
+
+// opens the file under a placed cursor and reads up to the first record newer than its lamport counter
+static void seek_log_cursor(logCursor *c)
+{
+    open_log_cursor_segment(c, c->segment, c->offset);
+    while ((c->has_next = read_log_cursor_record(c, &c->next)) && c->next.lamportCounter <= c->after)
+        ;
+}
+
+// moves the cursor to the next record. returns 0 when the end of the log is reached
+static int advance_log_cursor(logCursor *c)
+{
+    if(c->events)
+    {
+        // a chunked cursor that is not at the end of the log has to be refilled
+        c->has_next = c->position < c->num_of_events;
+        if(c->has_next)
+            c->next = c->events[c->position++];
+        return c->has_next;
+    }
+    c->has_next = read_log_cursor_record(c, &c->next);
+    c->end_of_log = !c->has_next;
+    return c->has_next;
+}
+
+static void close_log_cursor(logCursor *c)
+{
+    if(c->file)
+        fclose(c->file);
+    free(c->events);
+    c->file = NULL;
+    c->events = NULL;
+    c->has_next = 0;
+}
+
+typedef struct {
+    logCursor cursor;
+    u_int32_t max_size;
+    u_int32_t overhead;
+    logRecords *records;
+    diskCallback done;
+    void *arg;
+} logRecordsRead;
+
+static void read_log_records_job(void *arg)  // disk thread
+{
+    logRecordsRead *r = (logRecordsRead *) arg;
+    logRecords *out = r->records;
+    char record[LOG_RECORD_MAX_SIZE];
+    u_int32_t size = 0, capacity = 0, length;
+    seek_log_cursor(&r->cursor);
+    while (r->cursor.has_next)
+    {
+        length = encode_log_record(&r->cursor.next, record) + r->overhead;
+        if(out->num_of_events && size + length > r->max_size)
+            break;
+        if(out->num_of_events == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            out->events = (logEvent *) realloc(out->events, capacity * sizeof(logEvent));
+        }
+        out->events[out->num_of_events++] = r->cursor.next;
+        size += length;
+        advance_log_cursor(&r->cursor);
+    }
+    out->end_of_log = !r->cursor.has_next;
+    close_log_cursor(&r->cursor);
+}
+
+static void finish_log_records_read(void *arg)
+{
+    logRecordsRead *r = (logRecordsRead *) arg;
+    r->done(r->arg);
+    free(r);
+}
+
+// reads the records of log <server_id> newer than <lamport_counter> on the disk thread, as many as fit in <max_size>
+// bytes (at least one) when each encoded record takes <overhead> more bytes. <done> is called on the event loop thread
+// once <records> is filled in; the records appended so far are committed first, so they are all seen
+void read_log_records(u_int32_t server_id, u_int32_t lamport_counter, u_int32_t max_size, u_int32_t overhead, logRecords *records, diskCallback done, void *arg)
+{
+    logRecordsRead *r = (logRecordsRead *) malloc(sizeof(logRecordsRead));
+    memset(records, 0, sizeof(logRecords));
+    place_log_cursor(&r->cursor, server_id, lamport_counter);
+    r->max_size = max_size;
+    r->overhead = overhead;
+    r->records = records;
+    r->done = done;
+    r->arg = arg;
+    flush_log_files();
+    submit_disk_job(read_log_records_job, finish_log_records_read, r);
+}
+
+// reads the rest of the log under a placed cursor into memory
+static void preload_log_cursor(logCursor *c)
+{
+    logEvent e;
+    u_int32_t capacity = 0;
+    seek_log_cursor(c);
+    if(!c->has_next)
+        return;
+    while (read_log_cursor_record(c, &e))
+    {
+        if(c->num_of_events == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            c->events = (logEvent *) realloc(c->events, capacity * sizeof(logEvent));
         }
+        c->events[c->num_of_events++] = e;
+    }
+    if(c->events == NULL)   // only <next> was left, mark the cursor as preloaded anyway
+        c->events = (logEvent *) malloc(sizeof(logEvent));
+    if(c->file)
+        fclose(c->file);
+    c->file = NULL;
+    c->end_of_log = 1;
+    log_debug("preloaded %d records after lc %d of log file %d", c->num_of_events + 1, c->after, c->server_id);
+}
+
+// reads the next LOG_MERGE_CHUNK_RECORDS records under a cursor into <events> (disk thread).
+// the first chunk seeks the placed cursor; later ones go on where the previous chunk stopped
+static void load_log_cursor_chunk(logCursor *c)
+{
+    logEvent e;
+    if(c->file == NULL)
+        seek_log_cursor(c);
+    else
+        c->has_next = read_log_cursor_record(c, &c->next);
+    c->num_of_events = 0;
+    c->position = 0;
+    c->end_of_log = !c->has_next;
+    if(!c->has_next)
+        return;
+    if(c->events == NULL)
+        c->events = (logEvent *) malloc(LOG_MERGE_CHUNK_RECORDS * sizeof(logEvent));
+    while (c->num_of_events < LOG_MERGE_CHUNK_RECORDS && read_log_cursor_record(c, &e))
+        c->events[c->num_of_events++] = e;
+    c->end_of_log = c->num_of_events < LOG_MERGE_CHUNK_RECORDS;
+}
+
+static void preload_log_merge_cursor(u_int32_t job, void *arg)  // recovery threads
+{
+    preload_log_cursor(&((logMerge *) arg)->cursors[job]);
+}
+
+// heap order: lower lamport counter first, ties go to the lower server id
+static int log_cursor_less(logCursor *a, logCursor *b)
+{
+    if(a->next.lamportCounter != b->next.lamportCounter)
+        return a->next.lamportCounter < b->next.lamportCounter;
+    return a->server_id < b->server_id;
+}
+
+static void log_merge_sift_down(logMerge *m, u_int32_t i)
+{
+    u_int32_t smallest, left, right;
+    logCursor *tmp;
+    while (1)
+    {
+        smallest = i;
+        left = 2 * i + 1;
+        right = 2 * i + 2;
+        if(left < m->heap_size && log_cursor_less(m->heap[left], m->heap[smallest]))
+            smallest = left;
+        if(right < m->heap_size && log_cursor_less(m->heap[right], m->heap[smallest]))
+            smallest = right;
+        if(smallest == i)
+            return;
+        tmp = m->heap[i];
+        m->heap[i] = m->heap[smallest];
+        m->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void build_log_merge_heap(logMerge *m, u_int32_t num_servers)
+{
+    int i;
+    for(i = 0; i < num_servers; i++)
+    {
+        if(m->cursors[i].has_next)
+            m->heap[m->heap_size++] = &m->cursors[i];
+    }
+    for(i = (int) m->heap_size / 2 - 1; i >= 0; i--)
+        log_merge_sift_down(m, i);
+}
+
+// opens a cursor on each of the <num_servers> log files right after its last processed record, and waits for
+// the disk thread to get there first (startup only). with more than one thread, the log files are read into
+// memory in parallel first
+void open_log_merge(logMerge *m, u_int32_t num_servers, u_int32_t *last_processed_counters, int num_threads)
+{
+    int i;
+    memset(m, 0, sizeof(logMerge));
+    m->num_of_cursors = num_servers;
+    flush_log_files();
+    wait_disk_writes();
+    for(i = 0; i < num_servers; i++)
+        place_log_cursor(&m->cursors[i], i + 1, last_processed_counters[i]);
+    if(num_threads > 1)
+        run_parallel(num_threads, num_servers, preload_log_merge_cursor, m);
+    else
+        for(i = 0; i < num_servers; i++)
+            seek_log_cursor(&m->cursors[i]);
+    build_log_merge_heap(m, num_servers);
+}
+
+typedef struct {
+    logMerge *merge;
+    logCursor *cursor;      // the cursor to refill, NULL to load the first chunk of every cursor
+    diskCallback done;
+    void *arg;
+} logMergeLoad;
+
+static void load_log_merge_job(void *arg)  // disk thread
+{
+    logMergeLoad *load = (logMergeLoad *) arg;
+    u_int32_t i;
+    if(load->cursor)
+        load_log_cursor_chunk(load->cursor);
+    else
+        for(i = 0; i < load->merge->num_of_cursors; i++)
+            load_log_cursor_chunk(&load->merge->cursors[i]);
+}
+
+static void finish_log_merge_load(void *arg)
+{
+    logMergeLoad *load = (logMergeLoad *) arg;
+    load->merge->starved = NULL;
+    load->merge->heap_size = 0;
+    build_log_merge_heap(load->merge, load->merge->num_of_cursors);
+    load->done(load->arg);
+    free(load);
+}
+
+static void submit_log_merge_load(logMerge *m, logCursor *c, diskCallback done, void *arg)
+{
+    logMergeLoad *load = (logMergeLoad *) malloc(sizeof(logMergeLoad));
+    load->merge = m;
+    load->cursor = c;
+    load->done = done;
+    load->arg = arg;
+    // the records appended so far are committed first, so the chunk includes them
+    flush_log_files();
+    submit_disk_job(load_log_merge_job, finish_log_merge_load, load);
+}
+
+// like open_log_merge, but the records are read on the disk thread, behind the queued appends, a chunk of
+// LOG_MERGE_CHUNK_RECORDS records per log at a time. <done> is called on the event loop thread once the
+// first chunks are loaded; when next_merged_log_event asks for a refill, refill_log_merge loads the next chunk
+void load_log_merge(logMerge *m, u_int32_t num_servers, u_int32_t *last_processed_counters, diskCallback done, void *arg)
+{
+    u_int32_t i;
+    memset(m, 0, sizeof(logMerge));
+    m->num_of_cursors = num_servers;
+    for(i = 0; i < num_servers; i++)
+        place_log_cursor(&m->cursors[i], i + 1, last_processed_counters[i]);
+    submit_log_merge_load(m, NULL, done, arg);
+}
+
+// loads the next chunk of the cursor that ran out of records on the disk thread, then calls <done> on the event loop thread
+void refill_log_merge(logMerge *m, diskCallback done, void *arg)
+{
+    submit_log_merge_load(m, m->starved, done, arg);
+}
+
+// pops the next event across all logs in (lamport counter, server id) order into <e>.
+// returns LOG_MERGE_EVENT, LOG_MERGE_END when every log is exhausted, or LOG_MERGE_REFILL when the
+// cursor of a chunked merge ran out of loaded records: its log may hold the next event, so it is refilled first
+int next_merged_log_event(logMerge *m, logEvent *e, u_int32_t *server_id)
+{
+    logCursor *c;
+    if(m->starved)
+        return LOG_MERGE_REFILL;
+    if(m->heap_size == 0)
+        return LOG_MERGE_END;
+    c = m->heap[0];
+    *e = c->next;
+    *server_id = c->server_id;
+    if(!advance_log_cursor(c))
+    {
+        m->heap[0] = m->heap[--m->heap_size];
+        if(!c->end_of_log)
+            m->starved = c;
     }
+    log_merge_sift_down(m, 0);
+    return LOG_MERGE_EVENT;
+}
+
+void close_log_merge(logMerge *m)
+{
+    int i;
+    for(i = 0; i < NUM_SERVERS; i++)
+        close_log_cursor(&m->cursors[i]);
+    m->heap_size = 0;
+    m->starved = NULL;
 }
@@ -14,26 +14,255 @@
 #include "log.h"
 #include "chat_include.h"
 
-FILE ** log_files; 
+// Binary log record layout (all integers in host byte order, like the rest of our wire format):
+//	[magic:1][event type:1][chatroom length:1][payload format:1][lamport counter:4][payload length:4][chatroom][payload]
+// Legacy text lines ("%u~%s~%c~%s\n") always start with a digit, so the magic byte tells the two formats apart.
+#define LOG_RECORD_MAGIC 0xA5
+
+// The payload holds the fields of the event as wire strings and integers:
+//	append: [username][message]			like/unlike: [username][message server id:4][message lamport counter:4]
+// Records written before the fields were encoded have a "~" separated text payload (format 0); they are
+// converted when read, so the rest of the server only sees the encoded fields.
+#define LOG_PAYLOAD_TEXT 0
+#define LOG_PAYLOAD_FIELDS 1
+#define LOG_RECORD_HEADER_SIZE 12
+#define LOG_RECORD_MAX_SIZE (LOG_RECORD_HEADER_SIZE + sizeof(((logEvent *)0)->chatroom) + sizeof(((logEvent *)0)->payload))
+
+// Every LOG_INDEX_INTERVAL-th record of a log gets an entry in its sidecar index (<me>_server<N>.idx),
+// so queries by lamport counter can seek close to the requested position instead of scanning the whole log.
+#define LOG_INDEX_INTERVAL 64
+
+typedef struct {
+	u_int32_t lamportCounter;	// lamport counter of the indexed record
+	u_int32_t segment;			// segment holding the indexed record
+	u_int64_t offset;			// byte offset of the indexed record in its segment
+} logIndexEntry;
+
+typedef struct {
+	int fd;							// sidecar index file, written by disk jobs
+	logIndexEntry *entries;			// in-memory copy of the index, sorted by lamport counter
+	u_int32_t num_of_entries;
+	u_int32_t capacity;
+	u_int32_t records_since_entry;	// records appended after the last index entry
+} logIndex;
+
+// Each log is split into segment files (<me>_server<N>.<segment>.log) of LOG_SEGMENT_SIZE bytes.
+// A segment is preallocated when it is created, so appends overwrite zeroed space instead of growing the file,
+// and readers stop at the first zero byte. When the next record does not fit, the segment is sealed with a footer
+// in its last bytes and appends move on to a new segment. Old segments are retired by deleting their files.
+// Once the active segment is half full, the next one is created and preallocated on the disk thread under a
+// spare name (<me>_server<N>.<segment>.new) and renamed when appends move on to it.
+#define LOG_SEGMENT_SIZE (4 * 1024 * 1024)
+#define LOG_SEGMENT_MAGIC 0x5345474d
+
+typedef struct {
+	u_int32_t terminator;				// always 0, so readers stop in front of the footer
+	u_int32_t magic;					// LOG_SEGMENT_MAGIC
+	u_int32_t first_lamport_counter;	// lowest lamport counter in the segment
+	u_int32_t last_lamport_counter;		// highest lamport counter in the segment
+	u_int32_t num_of_records;
+	u_int32_t reserved;
+	u_int64_t data_size;				// bytes of records at the start of the segment
+} logSegmentFooter;
+
+// the live segments of one log: first_segment ... active_segment
+typedef struct {
+	u_int32_t first_segment;		// oldest segment that was not retired
+	u_int32_t active_segment;		// segment taking the appends
+	logSegmentFooter *footers;		// footer of every live segment, the active one is kept up to date in memory
+	u_int32_t capacity;
+	int fd;							// active segment
+	int spare_fd;					// segment active_segment + 1, created ahead on the disk thread (-1 until it is ready)
+	int creating_spare;				// 1 while the spare segment is being created
+} logSegments;
+
+// A read cursor over one log. It has its own file handle (and stdio buffer), so several cursors can stream
+// through the logs sequentially. It is placed on the event loop thread and read on the disk or recovery threads.
+// A preloaded cursor has read all of its records into <events> up front (used for parallel startup recovery).
+// A cursor of load_log_merge reads LOG_MERGE_CHUNK_RECORDS records at a time into <events> on the disk thread.
+typedef struct {
+	u_int32_t server_id;	// the log this cursor reads
+	u_int32_t segment;		// segment open in <file>
+	u_int32_t last_segment;	// the active segment when the cursor was placed, later segments are not read
+	u_int64_t offset;		// where reading starts in <segment>
+	u_int32_t after;		// records up to this lamport counter are skipped
+	FILE *file;
+	logEvent next;			// the record under the cursor
+	int has_next;			// whether <next> holds a record
+	logEvent *events;		// preloaded records after <next>
+	u_int32_t num_of_events;
+	u_int32_t position;		// next preloaded record to move to
+	int end_of_log;			// whether the last record was read from the file
+} logCursor;
+
+// records of one log read on the disk thread (see read_log_records)
+typedef struct {
+	logEvent *events;		// malloc'ed
+	u_int32_t num_of_events;
+	int end_of_log;			// whether the last record of the log was read
+} logRecords;
+
+#define LOG_MERGE_CHUNK_RECORDS 1024	// records of each log a merge of load_log_merge holds in memory
+
+// results of next_merged_log_event
+#define LOG_MERGE_END 0
+#define LOG_MERGE_EVENT 1
+#define LOG_MERGE_REFILL 2				// a cursor ran out of loaded records, see refill_log_merge
+
+// k-way merge of the per-server log files in (lamport counter, server id) order
+typedef struct {
+	logCursor cursors[NUM_SERVERS];
+	logCursor *heap[NUM_SERVERS];	// min-heap of the cursors that still have records
+	u_int32_t heap_size;
+	u_int32_t num_of_cursors;
+	logCursor *starved;				// out of the heap until its next chunk is loaded
+} logMerge;
+
+// How appends to the log files are made durable (the writes themselves run on the disk thread):
+//	NONE  -> every record is written right away but never synced (page cache only)
+//	GROUP -> records are buffered and committed with one write + fdatasync per log file,
+//			 when the batch reaches the record or age limit, or when flush_log_files() is called at the end of an event loop pass
+//	FSYNC -> every record is written and fdatasync'ed on its own
+// after_log_commit() callbacks run once the records appended before them are committed
+enum LogDurability
+{
+	LOG_DURABILITY_NONE,
+	LOG_DURABILITY_GROUP,
+	LOG_DURABILITY_FSYNC
+};
+
+#define LOG_GROUP_COMMIT_RECORDS 64		// default maximum records per group commit
+#define LOG_GROUP_COMMIT_USEC 2000		// default maximum age of the oldest buffered record
+#define LOG_COMMIT_STATS_INTERVAL 1000	// print commit statistics every this many commits
+
+// counters to tune the group commit
+typedef struct {
+	u_int64_t commits;				// number of commits (write + sync rounds)
+	u_int64_t records;				// records committed
+	u_int64_t bytes;				// bytes committed
+	u_int32_t max_batch;			// largest number of records in one commit
+	u_int64_t total_latency_usec;	// time spent in write + fdatasync
+	u_int64_t max_latency_usec;		// slowest commit
+} logCommitStats;
+
+#define CHATROOM_FILE_CACHE_SIZE 64	// chatroom files kept open at the same time
+
+// a chatroom file in the LRU cache
+// every archived line has its byte offset in the sidecar index (<me>_<chatroom>.chatroom.idx, one u_int64_t per line),
+// so the last N lines can be read without scanning the archive.
+// archived lines are never rewritten: likes and unlikes of archived messages are appended to the likes journal
+// (<me>_<chatroom>.chatroom.likes) and applied when the archive is read. the entries of each line are chained
+// from the newest one, found in the likes index (<me>_<chatroom>.chatroom.likes.idx, one u_int64_t per line),
+// so a read only visits the entries of the lines it returns.
+//
+// The files are only touched by disk jobs: a chatroom file is opened, written, read and closed on the disk thread,
+// in the order the jobs were queued, so the descriptors and sizes (chatroomArchive) belong to the disk thread.
+typedef struct {
+	char filename[50];				// the chatroom archive
+	int fd;							// chatroom archive, -1 if it could not be opened
+	int index_fd;					// line offset index of the archive
+	int likes_fd;					// likes journal of the archive
+	int likes_index_fd;				// newest likes journal entry of each archived line
+	u_int32_t num_of_records;		// lines in the archive
+	u_int64_t size;					// end of the archive
+	u_int64_t likes_size;			// end of the likes journal
+} chatroomArchive;
+
+typedef struct chatroomFile_t {
+	char chatroom[20];
+	chatroomArchive *archive;		// passed to the disk jobs of the chatroom, not read on the event loop
+	struct chatroomFile_t *prev;	// LRU list, most recently used first
+	struct chatroomFile_t *next;
+} chatroomFile;
+
+// called on the event loop thread when a disk job has finished
+typedef void (*diskCallback)(void *arg);
+
+// the LTS of an archived line
+typedef struct {
+	u_int32_t serverID;
+	u_int32_t lamportCounter;
+} archivedMessage;
+
+// what startup recovery needs from one chatroom archive
+typedef struct {
+	char chatroom[20];
+	u_int32_t last_lamport_counters[NUM_SERVERS];	// highest archived lamport counter of each server
+	archivedMessage *messages;						// LTS of every line of the archive, in line order (malloc'ed)
+	u_int32_t num_of_messages;
+} chatroomArchiveInfo;
+
+extern logSegments * log_segments;
+extern logIndex * log_indexes;
 
 void get_chatroom_file_name(u_int32_t me, char *chatroom, char *filename);
 
+int start_disk_writer();
+
+void run_disk_completions();
+
+void wait_disk_writes();
+
 void create_log_files(u_int32_t me, u_int32_t num_of_servers, int recreate, int *fds);
 
+void retire_log_segments(u_int32_t server_id, u_int32_t lamport_counter);
+
 void create_chatroom_file(u_int32_t me, char *chatroom_name, int recreate);
 
-void addEventToLogFile(u_int32_t server_id, char *line);
+void close_chatroom_files();
+
+chatroomArchiveInfo *scan_chatroom_archives(u_int32_t me, int num_threads, u_int32_t *num_of_archives);
+
+int get_recovery_threads();
+
+void write_snapshot_file(u_int32_t me, char *buffer, u_int32_t size, int *written, diskCallback done, void *arg);
+
+char *read_snapshot_file(u_int32_t me, u_int32_t *size);
+
+u_int32_t encode_log_record(logEvent *e, char *buffer);
+
+int decode_log_record(const char *buffer, u_int32_t size, logEvent *e);
+
+void set_append_payload(logEvent *e, const char *username, const char *message, u_int32_t message_length);
+
+void set_like_payload(logEvent *e, const char *username, u_int32_t pid, u_int32_t counter);
+
+int get_append_payload(const logEvent *e, char *username, char *message, u_int32_t *message_length);
+
+int get_like_payload(const logEvent *e, char *username, u_int32_t *pid, u_int32_t *counter);
+
+int read_log_record(FILE *f, logEvent *e);
+
+void set_log_durability(enum LogDurability mode, u_int32_t group_records, u_int32_t group_usec);
+
+void addEventToLogFile(u_int32_t server_id, logEvent *e);
+
+void flush_log_files();
+
+void after_log_commit(diskCallback done, void *arg);
+
+void get_log_commit_stats(logCommitStats *stats);
 
 void parseLineInLogFile(char *line, logEvent *e);
 
 void addMessageToChatroomFile(u_int32_t me, char *chatroom, Message m);
 
+void addLikeToChatroomFile(u_int32_t me, char *chatroom, u_int32_t line, u_int32_t server_id, u_int32_t lamport_counter, char type, char *username);
+
 void parseLineInMessagesFile(char *line, Message *m);
 
-void get_logs_newer_than(u_int32_t server_id, u_int32_t lamport_counter, u_int32_t *length, logEvent *logs);
+void retrieve_chatroom_history(u_int32_t me, char *chatroom, u_int32_t max_messages, u_int32_t *num_of_messages, Message *messages, diskCallback done, void *arg);
+
+void read_log_records(u_int32_t server_id, u_int32_t lamport_counter, u_int32_t max_size, u_int32_t overhead, logRecords *records, diskCallback done, void *arg);
+
+void open_log_merge(logMerge *m, u_int32_t num_servers, u_int32_t *last_processed_counters, int num_threads);
+
+void load_log_merge(logMerge *m, u_int32_t num_servers, u_int32_t *last_processed_counters, diskCallback done, void *arg);
+
+void refill_log_merge(logMerge *m, diskCallback done, void *arg);
 
-void retrieve_chatroom_history(u_int32_t me, char *chatroom, u_int32_t *num_of_messages, Message *mesages);
+int next_merged_log_event(logMerge *m, logEvent *e, u_int32_t *server_id);
 
-void retrieve_line_from_logs(logEvent *e, u_int32_t *available_data, u_int32_t num_servers, u_int32_t *last_processed_counters);
+void close_log_merge(logMerge *m);
 
 #endif
@@ -0,0 +1,142 @@
+#include "nameMap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_MAP_INITIAL_CAPACITY 64
+
+// FNV-1a. never returns 0 since that marks an empty slot
+static u_int32_t hash_name(const char *name)
+{
+    u_int32_t hash = 2166136261u;
+    while(*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// distance of the entry in <slot> from the slot its hash points to
+static u_int32_t probe_distance(const nameMap *map, u_int32_t hash, u_int32_t slot)
+{
+    return (slot + map->capacity - (hash & (map->capacity - 1))) & (map->capacity - 1);
+}
+
+void name_map_init(nameMap *map)
+{
+    memset(map, 0, sizeof(nameMap));
+}
+
+// returns the slot of <name>, or -1 if it is not in the map
+static int64_t find_slot(const nameMap *map, const char *name)
+{
+    u_int32_t hash, slot, distance;
+    if(map->size == 0)
+        return -1;
+    hash = hash_name(name);
+    slot = hash & (map->capacity - 1);
+    for(distance = 0; map->entries[slot].hash != 0; distance++)
+    {
+        // every entry from here on is closer to home than <name> would be
+        if(probe_distance(map, map->entries[slot].hash, slot) < distance)
+            return -1;
+        if(map->entries[slot].hash == hash && !strcmp(map->entries[slot].name, name))
+            return slot;
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return -1;
+}
+
+// places <entry>, which is not in the map, displacing entries that are closer to their home slot
+static void insert_entry(nameMap *map, nameEntry entry)
+{
+    nameEntry displaced;
+    u_int32_t slot = entry.hash & (map->capacity - 1), distance = 0, existing;
+    while(map->entries[slot].hash != 0)
+    {
+        existing = probe_distance(map, map->entries[slot].hash, slot);
+        if(existing < distance)
+        {
+            displaced = map->entries[slot];
+            map->entries[slot] = entry;
+            entry = displaced;
+            distance = existing;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+        distance++;
+    }
+    map->entries[slot] = entry;
+    map->size++;
+}
+
+static void grow(nameMap *map)
+{
+    nameEntry *entries = map->entries;
+    u_int32_t i, capacity = map->capacity;
+    map->capacity = capacity ? capacity * 2 : NAME_MAP_INITIAL_CAPACITY;
+    map->entries = calloc(map->capacity, sizeof(nameEntry));
+    assert(map->entries);
+    map->size = 0;
+    for(i = 0; i < capacity; i++)
+        if(entries[i].hash != 0)
+            insert_entry(map, entries[i]);
+    free(entries);
+}
+
+// looks <name> up. returns 1 and sets <index> if it is in the map
+int name_map_get(const nameMap *map, const char *name, int32_t *index)
+{
+    int64_t slot = find_slot(map, name);
+    if(slot < 0)
+        return 0;
+    *index = map->entries[slot].index;
+    return 1;
+}
+
+// adds <name> or updates its index
+void name_map_put(nameMap *map, const char *name, int32_t index)
+{
+    nameEntry entry;
+    int64_t slot = find_slot(map, name);
+    if(slot >= 0)
+    {
+        map->entries[slot].index = index;
+        return;
+    }
+    // keep the load factor under 7/8
+    if((map->size + 1) * 8 > map->capacity * 7)
+        grow(map);
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, name, NAME_MAP_KEY_LENGTH - 1);
+    entry.hash = hash_name(entry.name);
+    entry.index = index;
+    insert_entry(map, entry);
+}
+
+// returns 1 if <name> was removed, 0 if it was not in the map
+int name_map_remove(nameMap *map, const char *name)
+{
+    u_int32_t next;
+    int64_t slot = find_slot(map, name);
+    if(slot < 0)
+        return 0;
+    // shift the following entries back by one until one is already in its home slot
+    next = (slot + 1) & (map->capacity - 1);
+    while(map->entries[next].hash != 0 && probe_distance(map, map->entries[next].hash, next) > 0)
+    {
+        map->entries[slot] = map->entries[next];
+        slot = next;
+        next = (next + 1) & (map->capacity - 1);
+    }
+    memset(&map->entries[slot], 0, sizeof(nameEntry));
+    map->size--;
+    return 1;
+}
+
+void name_map_free(nameMap *map)
+{
+    free(map->entries);
+    name_map_init(map);
+}
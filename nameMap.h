@@ -0,0 +1,37 @@
+#ifndef NAME_MAP_H
+#define NAME_MAP_H
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+//	Map from a name (a username or a chatroom name) to an index.
+//
+////////////////////////////////////////////////////////////////////////////////////
+
+#include <sys/types.h>
+
+#define NAME_MAP_KEY_LENGTH 20				// including the terminating 0, same as the username and chatroom name fields
+
+// Open addressing with Robin Hood probing: an entry being inserted takes the slot of any entry that
+// is closer to its home slot, which keeps probe sequences short and lets a lookup stop as soon as it
+// passes an entry closer to home than the key would be. The hash of every entry is stored so probing
+// and growing never rehash or compare keys needlessly, and deletion shifts the following entries back
+// instead of leaving tombstones. Keys are copied into the map.
+typedef struct {
+	u_int32_t hash;							// 0 marks an empty slot
+	char name[NAME_MAP_KEY_LENGTH];			// owned copy of the key
+	int32_t index;
+} nameEntry;
+
+typedef struct {
+	nameEntry *entries;
+	u_int32_t capacity;						// a power of two (0 until the first insert)
+	u_int32_t size;
+} nameMap;
+
+void name_map_init(nameMap *map);
+int name_map_get(const nameMap *map, const char *name, int32_t *index);
+void name_map_put(nameMap *map, const char *name, int32_t index);
+int name_map_remove(nameMap *map, const char *name);
+void name_map_free(nameMap *map);
+
+#endif
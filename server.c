@@ -10,34 +10,108 @@
 
 #include "chat_include.h"
 
-#include "include/HashSet/src/hash_set.h"
-#include "include/c_hashmap/hashmap.h"
 #include "list.h"
 #include "fileService.h"
-
+#include "usernames.h"
+#include "nameMap.h"
+#include "wireCodec.h"
+
+
+#define MAX_MESSAGES_PER_PASS 64		// messages handled per Read_message call before the log appends are committed
+#define SNAPSHOT_INTERVAL 1000			// processed log events between two snapshots of the session
+#define SNAPSHOT_MAGIC 0x534e4150
+#define SNAPSHOT_VERSION 4
+#define SERVER_UPDATE_BATCH_SIZE 32768	// bytes of log records packed into one TYPE_SERVER_UPDATE_BATCH at most
+#define SERVER_UPDATE_BATCH_DELAY 2000	// microseconds a log record waits for its batch to fill at most
+#define RESEND_WINDOW 4					// chunks of a resend multicast but not yet delivered back to us
+
+// Each chatroom keeps its last <window_size> messages in memory, older ones are moved to the chatroom file.
+// Every WINDOW_REBALANCE_INTERVAL appends the windows are resized: every chatroom gets the minimum window and
+// the rest of the memory budget is shared out in proportion to the recent appends of each chatroom.
+// The ring of a chatroom only grows up to its window as messages arrive, so quiet chatrooms stay small.
+#define WINDOW_MIN_SIZE CLIENT_UPDATE_MESSAGES		// default smallest window (a client update shows this many messages)
+#define WINDOW_MAX_SIZE 500							// default largest window
+#define WINDOW_MEMORY_BUDGET_MB 64					// default memory budget of all the windows
+#define WINDOW_REBALANCE_INTERVAL 1000				// appends between two rebalances
+#define WINDOW_LIMIT 65536							// sanity bound of a window loaded from a snapshot
+#define CLIENT_MESSAGE_MAX_SIZE (20 + sizeof(MessageText))	// a message in a client update or delta
+#define RING_SLOT_SIZE (sizeof(idSet) + sizeof(MessageHeader) + sizeof(MessageText))	// memory of one message slot (without the likers' ids)
+
+// what a chatroom owes its clients at the next flush_client_updates
+#define CLIENTS_UP_TO_DATE 0
+#define CLIENTS_NEED_DELTAS 1						// the queued deltas
+#define CLIENTS_NEED_FULL_UPDATE 2					// the full state (cheaper than the deltas, or too much changed)
 
 ///////////////////////// Server Data Structures   //////////////////////////////////////////////////////
 
+// where a message of a chatroom is: a slot of the in-memory ring or a line of the chatroom file
+typedef struct
+{
+	u_int32_t server_id;					// LTS of the message (server id 0 marks an empty entry)
+	u_int32_t lamport_counter;
+	u_int32_t archived;						// 1 if <position> is a line of the chatroom file, 0 if it is a slot of the ring
+	u_int32_t position;
+} MessageLocation;
+
+// The message ring is split in a hot part that scans and like counts touch (packed four to a cache line)
+// and a cold part with the text, which is only read when a message is sent out or moved to the chatroom file
+typedef struct
+{
+	u_int32_t server_id;					// LTS of the message
+	u_int32_t lamport_counter;
+	u_int32_t num_of_likers;
+	u_int8_t username_length;
+	u_int8_t message_length;
+	u_int16_t unused;
+} MessageHeader;
+
+typedef struct
+{
+	char username[20];						// not terminated, see MessageHeader.username_length
+	char message[80];						// not terminated, see MessageHeader.message_length
+} MessageText;
+
 // This struct stores all the chatroom data that are needed to be in memory
 typedef struct Chatroom_t
 {
 	char name[20];							// chatroom name
 	u_int32_t num_of_messages;				// number of messages residing in memory
-	Message messages[25];					// array of last 25 messages in the memory (only [num_of_messages] of the slots are full)
-	hash_set_st participants[NUM_SERVERS];	// array of hash sets containing participants connected to each server
-	hash_set_st likers[25];					// array of hash sets containing usernames of the message likers
-	u_int32_t num_of_likers[25];			// number of likers for each message
-	u_int32_t num_of_participants[5];		// number of chatroom participants connected to each server
+	void *slab;								// single allocation holding likers, headers and texts
+	MessageHeader *headers;					// ring of the last messages in memory (only [num_of_messages] of the slots are full)
+	MessageText *texts;						// text of each slot of headers
+	idSet participants[NUM_SERVERS];		// username ids of the participants connected to each server
+	idSet all_participants;					// union of participants[] (what clients are sent)
+	idSet *likers;							// username ids of the likers of each message
+	u_int32_t capacity;						// allocated slots of headers, texts and likers
+	u_int32_t window_size;					// most messages kept in memory
+	u_int32_t activity;						// appends since the last rebalance (halved at every rebalance)
+	u_int32_t version;						// bumped by every update multicast to clients (see flush_chatroom_updates)
+	u_int32_t dirty;						// CLIENTS_UP_TO_DATE, CLIENTS_NEED_DELTAS or CLIENTS_NEED_FULL_UPDATE
+	char *pending_deltas;					// deltas queued since the last flush (see queue_chatroom_delta)
+	u_int32_t pending_size;
+	u_int32_t pending_capacity;
+	u_int32_t num_of_pending;
 	u_int32_t message_start_pointer;		// to iterate over messages as a circular buffer
+	u_int32_t num_of_archived;				// number of messages moved from memory to the chatroom file
+	u_int32_t archive_skip;					// lines of <archive_tail> not evicted again yet
+	archivedMessage *archive_tail;			// LTS of the chatroom file lines written after the snapshot (when replaying logs after a restart)
+	u_int32_t archive_tail_start;			// line of archive_tail[0]
+	u_int32_t archive_tail_length;
+	u_int32_t archive_tail_next;			// first line of <archive_tail> not matched yet (matched lines are zeroed)
+	MessageLocation *locations;				// LTS -> location of every message of the chatroom (open addressing, linear probing)
+	u_int32_t locations_capacity;			// a power of two
+	u_int32_t num_of_locations;
 } Chatroom;
 
 // This struct stores the server session information
 typedef struct Session_t
 {
 	u_int32_t server_id;			   		// my ID
-	Chatroom chatrooms[MAX_CHATROOMS]; 		// chatroom data list
+	Chatroom *chatrooms; 					// chatroom data list, grows as chatrooms are created
+	u_int32_t chatrooms_capacity;			// allocated slots in chatrooms
+	nameMap chatroom_indexes;				// chatroom name -> index in chatrooms
 	int connected_clients;			   		// number of clients currently connected to me
-	map_t clients;					  		// connected clients and their chatroom ID
+	nameMap clients;				  		// connected clients and their chatroom index
 	int num_of_chatrooms;			 		// to keep track of in-memory data structures
 	u_int32_t membership[5];		   		// Membership status of each server
 	u_int32_t lamport_counters[5][5];  		// Stores the last received lamport counter from each server according to each server's view
@@ -46,15 +120,87 @@ typedef struct Session_t
 	Node *unprocessed_update_start;	   		// client updates received during reconciliation
 	u_int32_t unprocessed_updates_count;	// number of client updates received during reconciliation
 	u_int32_t processed_lamport_counters[5]; // lamport counters processed from the log files of each server 
+	u_int32_t events_since_snapshot;		// log events processed since the last snapshot
+	int writing_snapshot;					// a snapshot is being written on the disk thread
+	int snapshot_written;					// whether it was installed (set by write_snapshot_file)
+	u_int32_t snapshot_processed[5];		// processed lamport counters the snapshot being written covers
+	u_int32_t reconciliations;				// bumped whenever a server joins and we start reconciling
+	int returning_to_primary;				// the log records to process before returning to primary are being read
+	u_int32_t replay_reconciliation;		// <reconciliations> when they started to be read
+	logMerge replay;						// those records (see return_to_primary)
+	int disk_fd;							// readable when disk jobs have finished (-1 if disk I/O runs inline)
+	u_int32_t *dirty_chatrooms;				// indexes of the chatrooms with updates for their clients
+	u_int32_t num_of_dirty;
+	u_int32_t dirty_capacity;
 } Session;
 
+// sizes of the in-memory windows
+typedef struct
+{
+	u_int32_t min_size;
+	u_int32_t max_size;
+	u_int64_t budget;						// bytes
+	u_int32_t appends_since_rebalance;
+} WindowConfig;
+
+// a log record of ours to multicast to the servers once it is committed to our log
+typedef struct
+{
+	u_int32_t server_id;
+	u_int32_t record_length;
+	char record[LOG_RECORD_MAX_SIZE];
+} PendingLogUpdate;
+
+// log records waiting to be multicast to the servers together: the origin server id, length and record of each
+typedef struct
+{
+	wireWriter writer;						// the batch message being written (if num_of_records > 0)
+	char *count;							// where the number of records goes in <writer>
+	u_int32_t num_of_records;
+	u_int32_t size;							// bytes of records
+	u_int32_t timer_queued;					// 1 while Flush_server_updates is queued to send the batch
+} ServerUpdateBatch;
+
+// A resend of the log of one server to the servers missing part of it. The log is read on the disk thread in
+// chunks of up to SERVER_UPDATE_BATCH_SIZE bytes. Spread delivers our own multicasts back to us in the same
+// agreed order as to the others, so a chunk we get back has reached every server in the membership; at most
+// RESEND_WINDOW chunks are in flight at a time.
+typedef struct
+{
+	u_int32_t active;
+	u_int32_t reading;						// 1 while the next chunk is read from the log
+	u_int32_t restarted;					// the resend restarted during the read, its chunk is dropped
+	u_int32_t end_of_log;					// the last chunk read reached the end of the log
+	logRecords chunk;						// records of the chunk being read
+	u_int32_t position;						// lamport counter of the last record sent
+	u_int32_t sequence;						// of the last chunk sent, matches the chunks that come back to their stream
+	u_int32_t in_flight[RESEND_WINDOW];		// sequence of each chunk in flight, oldest first
+	u_int32_t num_in_flight;
+} ResendStream;
+
+// a history response waiting for the archived messages to be read
+typedef struct
+{
+	char username[20];
+	u_int32_t num_of_archived;						// messages read from the chatroom file
+	u_int32_t num_of_recent;						// in-memory messages when the history was requested
+	Message archived[MAX_HISTORY_MESSAGES];
+	Message recent[MAX_HISTORY_MESSAGES];
+} PendingHistory;
+
 ///////////////////////// Global Variables //////////////////////////////////////////////////////
 
 Session current_session;
+WindowConfig window_config = {WINDOW_MIN_SIZE, WINDOW_MAX_SIZE, (u_int64_t)WINDOW_MEMORY_BUDGET_MB << 20, 0};
+ServerUpdateBatch server_update_batch;
+ResendStream resend_streams[NUM_SERVERS];	// by the server whose log is resent
 
 //////////////////////////   Declarations    ////////////////////////////////////////////////////
 
 static void Read_message();
+static void Disk_completions();
+static void Receive_message();
+static void Flush_server_updates(int code, void *data);
 static void Usage(int argc, char *argv[]);
 static void Bye();
 
@@ -65,100 +211,41 @@ static void handle_server_join(u_int32_t server_id);
 static void handle_server_leave(u_int32_t server_id);
 static int handle_join(char *message, int size);
 static int handle_append(char *message, int msg_size);
-static int handle_like_unlike(char *message, char event_type);
-static int handle_history();
+static int handle_like_unlike(char *message, int size);
+static int handle_history(char *message, u_int32_t size);
+static int handle_resync(char *message, u_int32_t size);
 static int handle_membership_status(char *message, int msg_size);
 static int process_log_files(u_int32_t startup);
+static void return_to_primary();
+static void finish_return_to_primary(void *arg);
 
 static int handle_unprocessed_updates();
 static int check_primary_conditions();
 static int send_anti_entropy_to_server(u_int32_t server_id);
 static int create_new_chatroom(char *chatroom, int no_create_file);
 static int find_chatroom_index(char *chatroom);
+static void reset_chatroom_indexes();
+static void set_message_location(Chatroom *c, u_int32_t server_id, u_int32_t lamport_counter, u_int32_t archived, u_int32_t position);
+static MessageLocation *find_message_location(Chatroom *c, u_int32_t server_id, u_int32_t lamport_counter);
 static int parse(char *message, int size, int num_groups);
-static int handle_server_update();
+static int handle_server_update_batch(char *message, int size);
+static int apply_server_update(u_int32_t sender_id, u_int32_t server_id, u_int32_t log_length, const char *record);
 static int handle_participant_update(char *message, int msg_size);
 static int handle_anti_entropy();
 static int handle_client_membership_change();
-static void update_chatroom_data(int chatroom_index, char *chatroom, char *username, u_int32_t payload_length, char *payload, logEvent e, u_int32_t serverID, int dump);
-
-////////////////////////// Utility Functions for working with hash sets and files ////////////////////////////////////////
-
-// The hash function for hash set
-// inputs: string value
-// outputs: int value of the string hash
-u_int32_t chksum(const void *str)
-{
-	char *s = (char *)str;
-	int len = strlen(s);
-	int i;
-	uint32_t c = 0;
-
-	for (i = 0; i < len; ++i)
-	{
-		c = (c >> 1) + ((c & 1) << (32 - 1));
-		c += s[i];
-	}
-	return (c);
-}
-
-// remove from hash set 
-// Inputs:
-//		old_hashset -> the hash set to remove from
-//		length -> current length of the hash set
-//		username -> the value to be removed
-// outputs: count of elements in hashset
-int hash_set_remove(hash_set_st *old_hashset, u_int32_t length, char *username)
-{
-	hash_set_it *it;
-	int j, count = 0;
-	char *value;
-	log_debug("removing from hash set with length %d", length);
-	hash_set_st *temp = hash_set_init(chksum);
-	log_debug("hash set init");
-	it = it_init(old_hashset);
-	log_debug("iterator init");
-	for (j = 0; j < length; j++)
-	{
-		value = (char *)it_value(it);
-		log_debug("value %s", value);
-		if (strcmp(value, username))
-		{
-			log_debug("inserting into temp");
-			hash_set_insert(temp, value, strlen(value));
-			count++;
-			log_debug("temp count is %d", count);
-		}
-		it_next(it);
-	}
-	log_debug("hash set clear");
-	hash_set_clear(old_hashset);
-	log_debug("hash set iterator init");
-	it = it_init(temp);
-	for (j = 0; j < count; j++)
-	{
-		value = (char *)it_value(it);
-		hash_set_insert(old_hashset, value, strlen(value));
-		it_next(it);
-	}
-	return count;
-}
-
-// returns the extension of a file
-// used to find chatroom files in the base directory
-static const char *get_filename_ext(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if(!dot || dot == filename) return "";
-    return dot + 1;
-}
-
-// creates a log line from logEvent struct of <e>
-// returnes the <line>
-void createLogLine(u_int32_t server_id, logEvent e, char *line)
-{
-	sprintf(line, "%u~%s~%c~%s\n", e.lamportCounter, e.chatroom, e.eventType, e.payload);
-	log_debug("log line is %s", line);
-}
+static void update_chatroom_data(int chatroom_index, char *chatroom, char *username, u_int32_t payload_length, const char *payload, logEvent e, u_int32_t serverID, int dump);
+static int write_snapshot();
+static void snapshot_written(void *arg);
+static int load_snapshot();
+static void resize_message_ring(Chatroom *c, u_int32_t capacity);
+static void free_chatroom(Chatroom *c);
+static void retire_old_log_segments(u_int32_t *processed);
+static void mark_event_processed(u_int32_t server_id, u_int32_t lamport_counter);
+static void flush_client_updates();
+static int handle_resend_chunk(char *message, int size);
+static int apply_server_updates(wireReader *r, u_int32_t sender_id);
+static void resend_chunk_delivered(u_int32_t server_id, u_int32_t sequence);
+static void reset_resend_windows();
 
 //////////////////////////   Core Functions  ////////////////////////////////////////////////////
 
@@ -191,6 +278,8 @@ int main(int argc, char *argv[])
 	initialize();
 
 	E_attach_fd(Mbox, READ_FD, Read_message, 0, NULL, LOW_PRIORITY);
+	if (current_session.disk_fd >= 0)
+		E_attach_fd(current_session.disk_fd, READ_FD, Disk_completions, 0, NULL, HIGH_PRIORITY);
 
 	E_handle_events();
 
@@ -198,7 +287,28 @@ int main(int argc, char *argv[])
 }
 
 // Spread event handler
+// handles the messages already waiting in the mailbox in one pass,
+// so the log appends they cause are committed together (one write + fdatasync per log file in group commit mode)
 static void Read_message()
+{
+	int handled = 0;
+	do
+	{
+		Receive_message();
+	} while (++handled < MAX_MESSAGES_PER_PASS && SP_poll(Mbox) > 0);
+	flush_log_files();
+	flush_client_updates();
+}
+
+// disk thread event handler: runs the follow-ups of the finished disk jobs (multicasts of committed records, history responses)
+static void Disk_completions()
+{
+	run_disk_completions();
+	flush_client_updates();
+}
+
+// receive and handle one message from Spread
+static void Receive_message()
 {
 	static char mess[MAX_MESSLEN];
 	char sender[MAX_GROUP_NAME];
@@ -293,6 +403,7 @@ static void Read_message()
 					cnt++;
 				current_session.membership[i] = new_memberships[i];
 			}
+			reset_resend_windows();
 			if(join && cnt > 1)
 				handle_server_join(0);
 		}
@@ -319,13 +430,14 @@ static void Read_message()
 // parse command line arguments
 static void Usage(int argc, char *argv[])
 {
+	u_int32_t group_records = 0, group_usec = 0, budget_mb = WINDOW_MEMORY_BUDGET_MB;
 	sprintf(Spread_name, "10330");
-	if (argc != 2 && argc != 3)
+	if (argc < 2 || argc > 5)
 	{
-		printf("Usage: ./server [server_id 1-5] [log_level]\n");
+		printf("Usage: ./server [server_id 1-5] [log_level] [durability none|fsync|group[:records[:usec]]] [window min:max:budget_mb]\n");
 		exit(0);
 	}
-	if (argc == 3)
+	if (argc >= 3)
 	{
 		log_level = atoi(argv[2]);
 		log_set_level(log_level);
@@ -333,6 +445,33 @@ static void Usage(int argc, char *argv[])
 	else{
 		log_set_level(LOG_INFO);
 	}
+	if (argc >= 4)
+	{
+		if (!strcmp(argv[3], "none"))
+			set_log_durability(LOG_DURABILITY_NONE, 0, 0);
+		else if (!strcmp(argv[3], "fsync"))
+			set_log_durability(LOG_DURABILITY_FSYNC, 0, 0);
+		else if (!strncmp(argv[3], "group", 5))
+		{
+			sscanf(argv[3], "group:%u:%u", &group_records, &group_usec);
+			set_log_durability(LOG_DURABILITY_GROUP, group_records, group_usec);
+		}
+		else
+		{
+			printf("invalid durability mode %s\n", argv[3]);
+			exit(0);
+		}
+	}
+	if (argc == 5)
+	{
+		if (sscanf(argv[4], "%u:%u:%u", &window_config.min_size, &window_config.max_size, &budget_mb) != 3 ||
+			window_config.min_size == 0 || window_config.min_size > window_config.max_size || window_config.max_size > WINDOW_LIMIT)
+		{
+			printf("invalid window %s (expected min:max:budget_mb with 0 < min <= max <= %d)\n", argv[4], WINDOW_LIMIT);
+			exit(0);
+		}
+		window_config.budget = (u_int64_t)budget_mb << 20;
+	}
 	sprintf(User, "%s", argv[1]);
 	current_session.server_id = atoi(argv[1]);
 }
@@ -344,6 +483,10 @@ static void Bye()
 
 	log_info("\nBye.\n");
 
+	flush_log_files();
+	wait_disk_writes();
+	run_disk_completions();
+	close_chatroom_files();
 	SP_disconnect(Mbox);
 
 	exit(0);
@@ -371,11 +514,12 @@ static int parse(char *message, int size, int num_groups)
 	case TYPE_HISTORY:
 		handle_history(message, size);
 		break;
-	case TYPE_LIKE:
-		handle_like_unlike(message, TYPE_LIKE);
+	case TYPE_RESYNC:
+		handle_resync(message, size);
 		break;
+	case TYPE_LIKE:
 	case TYPE_UNLIKE:
-		handle_like_unlike(message, TYPE_UNLIKE);
+		handle_like_unlike(message, size);
 		break;
 	case TYPE_MEMBERSHIP_STATUS:
 		handle_membership_status(message, size);
@@ -383,8 +527,11 @@ static int parse(char *message, int size, int num_groups)
 	case TYPE_ANTY_ENTROPY:
 		handle_anti_entropy(message, size);
 		break;
-	case TYPE_SERVER_UPDATE:
-		handle_server_update(message, size);
+	case TYPE_SERVER_UPDATE_BATCH:
+		handle_server_update_batch(message, size);
+		break;
+	case TYPE_RESEND_CHUNK:
+		handle_resend_chunk(message, size);
 		break;
 	case TYPE_PARTICIPANT_UPDATE:
 		handle_participant_update(message, size);
@@ -400,55 +547,259 @@ static int parse(char *message, int size, int num_groups)
 }
 
 // creates chatroom LTS data from .chatroom files
-// it traverses the base directory and looks for .chatroom files
-// opens those files and creates the chatrooms and their data from lines in the file
+// the chatroom files in the base directory are parsed in parallel (see RECOVERY_THREADS),
+// then the chatrooms are created and our row of the lamport matrix updated in chatroom name order
 static void create_chatroom_from_files()
 {
-	DIR *directory;
-	struct dirent* file;
-	FILE *cf;
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
-	char chatroom_name[20];
-    Message m;
-    u_int32_t index, server_id;
-	directory = opendir(".");
-    if (directory == NULL) {
-        log_error("error opening base directory");
-        exit(2);
-    }
-
-    while ((file=readdir(directory)) != NULL) {
-        log_debug("filename: %s\n", file->d_name);
-		if(strcmp("chatroom", get_filename_ext(file->d_name)) == 0)
+	chatroomArchiveInfo *archives;
+	u_int32_t num_of_archives, i, j;
+	int index;
+	Chatroom *c;
+	archives = scan_chatroom_archives(current_session.server_id, get_recovery_threads(), &num_of_archives);
+	for (i = 0; i < num_of_archives; i++)
+	{
+		index = find_chatroom_index(archives[i].chatroom);
+		if (index == -1)
+			index = create_new_chatroom(archives[i].chatroom, 1);
+		log_debug("chatroom file found for room %s, idx = %d", archives[i].chatroom, index);
+		// every line is indexed, except the messages the snapshot still holds in memory
+		c = &current_session.chatrooms[index];
+		for (j = 0; j < archives[i].num_of_messages; j++)
+			if (j < c->num_of_archived || find_message_location(c, archives[i].messages[j].serverID, archives[i].messages[j].lamportCounter) == NULL)
+				set_message_location(c, archives[i].messages[j].serverID, archives[i].messages[j].lamportCounter, 1, j);
+		// the lines after the snapshot are evicted again by the log replay: they are matched to their line instead of written twice
+		if (archives[i].num_of_messages > c->num_of_archived)
 		{
-			sscanf(file->d_name, "%d_%[^.].chatroom", &server_id, chatroom_name);
-            if(server_id != current_session.server_id)
-                continue;
-            index = find_chatroom_index(chatroom_name);
-            if (index == -1)
-		        index = create_new_chatroom(chatroom_name, 1);
-			log_debug("chatroom file found %s for room %s, idx = %d", file->d_name, chatroom_name, index);
-            cf = fopen(file->d_name, "r");
-            if ( cf != NULL )
-            {
-                while ((read = getline(&line, &len, cf)) != -1) {
-                    parseLineInMessagesFile(line, &m);
-                    log_debug("updating our line in matrix to : LTS = %d, %d", m.serverID, m.lamportCounter);
-					current_session.lamport_counters[current_session.server_id-1][m.serverID - 1] = m.lamportCounter;
-                }
-            }
+			c->archive_tail_start = c->num_of_archived;
+			c->archive_tail_length = c->archive_skip = archives[i].num_of_messages - c->num_of_archived;
+			c->archive_tail = (archivedMessage *)malloc(c->archive_tail_length * sizeof(archivedMessage));
+			memcpy(c->archive_tail, archives[i].messages + c->num_of_archived, c->archive_tail_length * sizeof(archivedMessage));
+		}
+		free(archives[i].messages);
+		for (j = 0; j < NUM_SERVERS; j++)
+		{
+			// the snapshot may already know about newer data
+			if (archives[i].last_lamport_counters[j] > current_session.lamport_counters[current_session.server_id - 1][j])
+			{
+				log_debug("updating our line in matrix to : LTS = %d, %d", j + 1, archives[i].last_lamport_counters[j]);
+				current_session.lamport_counters[current_session.server_id - 1][j] = archives[i].last_lamport_counters[j];
+			}
 		}
 	}
-	closedir(directory);
+	free(archives);
 }
 
 // after we opened and read the chatroom files, we open the log files to process more recent updates
+// only the log records after the snapshot (if any) are replayed.
+// evictions during the replay that are already in a chatroom file are not written again
 static void update_chatroom_data_based_on_log_files()
 {
-	int startup = 1;	// sometimes we are not in startup, but want to process logs. then we can this function with 0
+	int i, startup = 1;	// sometimes we are not in startup, but want to process logs. then we can this function with 0
+	for (i = 0; i < current_session.num_of_chatrooms; i++)
+		log_debug("chatroom %s has %d archived messages after the snapshot", current_session.chatrooms[i].name, current_session.chatrooms[i].archive_skip);
+	current_session.events_since_snapshot = 0;
 	process_log_files(startup);
+	if (current_session.events_since_snapshot)
+		write_snapshot();
+}
+
+// appends <length> bytes of <data> to the growing snapshot <buffer>
+static void snapshot_put(char **buffer, u_int32_t *size, u_int32_t *capacity, const void *data, u_int32_t length)
+{
+	if (*size + length > *capacity)
+	{
+		while (*size + length > *capacity)
+			*capacity = *capacity ? *capacity * 2 : 65536;
+		*buffer = (char *)realloc(*buffer, *capacity);
+	}
+	memcpy(*buffer + *size, data, length);
+	*size += length;
+}
+
+// reads <length> bytes from the snapshot <buffer> at <offset>. returns 0 if the snapshot is too short
+static int snapshot_get(char *buffer, u_int32_t size, u_int32_t *offset, void *data, u_int32_t length)
+{
+	if (*offset + length > size)
+		return 0;
+	memcpy(data, buffer + *offset, length);
+	*offset += length;
+	return 1;
+}
+
+// checkpoints the session to the snapshot file:
+// lamport counters, processed counters and for each chatroom its in-memory messages and their likers.
+// participants are not saved since clients have to reconnect after a restart anyway
+static int write_snapshot()
+{
+	char *buffer = NULL;
+	u_int32_t size = 0, capacity = 0, value, length;
+	int i, j;
+	u_int32_t position, id, slot;
+	const char *username;
+	Chatroom *c;
+	if (current_session.writing_snapshot)
+		return 0;	// the next processed event tries again
+	// the snapshot must not cover log records that could still be lost
+	flush_log_files();
+	value = SNAPSHOT_MAGIC;
+	snapshot_put(&buffer, &size, &capacity, &value, 4);
+	value = SNAPSHOT_VERSION;
+	snapshot_put(&buffer, &size, &capacity, &value, 4);
+	value = sizeof(MessageHeader) + sizeof(MessageText);
+	snapshot_put(&buffer, &size, &capacity, &value, 4);
+	snapshot_put(&buffer, &size, &capacity, &current_session.lamport_counter, 4);
+	snapshot_put(&buffer, &size, &capacity, current_session.lamport_counters, sizeof(current_session.lamport_counters));
+	snapshot_put(&buffer, &size, &capacity, current_session.processed_lamport_counters, sizeof(current_session.processed_lamport_counters));
+	// the rebalance state, so the replay after a restart resizes the windows (and evicts) as the live traffic did
+	snapshot_put(&buffer, &size, &capacity, &window_config.appends_since_rebalance, 4);
+	snapshot_put(&buffer, &size, &capacity, &current_session.num_of_chatrooms, 4);
+	for (i = 0; i < current_session.num_of_chatrooms; i++)
+	{
+		c = &current_session.chatrooms[i];
+		snapshot_put(&buffer, &size, &capacity, c->name, sizeof(c->name));
+		snapshot_put(&buffer, &size, &capacity, &c->window_size, 4);
+		snapshot_put(&buffer, &size, &capacity, &c->activity, 4);
+		snapshot_put(&buffer, &size, &capacity, &c->num_of_messages, 4);
+		snapshot_put(&buffer, &size, &capacity, &c->num_of_archived, 4);
+		// the ring is written oldest message first
+		for (j = 0, slot = c->message_start_pointer; j < c->num_of_messages; j++, slot = (slot + 1) % c->capacity)
+		{
+			snapshot_put(&buffer, &size, &capacity, &c->headers[slot], sizeof(MessageHeader));
+			snapshot_put(&buffer, &size, &capacity, &c->texts[slot], sizeof(MessageText));
+			snapshot_put(&buffer, &size, &capacity, &c->likers[slot].count, 4);
+			// usernames are written out since ids are only valid in this process
+			position = 0;
+			while (id_set_next(&c->likers[slot], &position, &id))
+			{
+				username = get_username(id);
+				length = strlen(username);
+				snapshot_put(&buffer, &size, &capacity, &length, 4);
+				snapshot_put(&buffer, &size, &capacity, username, length);
+			}
+		}
+	}
+	// written on the disk thread, which takes the buffer over
+	memcpy(current_session.snapshot_processed, current_session.processed_lamport_counters, sizeof(current_session.snapshot_processed));
+	current_session.writing_snapshot = 1;
+	current_session.events_since_snapshot = 0;
+	write_snapshot_file(current_session.server_id, buffer, size, &current_session.snapshot_written, snapshot_written, NULL);
+	return 0;
+}
+
+static void snapshot_written(void *arg)
+{
+	u_int32_t *processed = current_session.snapshot_processed;
+	current_session.writing_snapshot = 0;
+	if (!current_session.snapshot_written)
+	{
+		log_error("could not write snapshot");
+		return;
+	}
+	log_info("wrote snapshot, processed lts = %d %d %d %d %d", processed[0], processed[1], processed[2], processed[3], processed[4]);
+	retire_old_log_segments(processed);
+}
+
+// once a snapshot covers them, log records are only needed to bring other servers up to date.
+// retire the log segments of each server that the snapshot covers (<processed>) and that every server has already received
+static void retire_old_log_segments(u_int32_t *processed)
+{
+	int i, j;
+	u_int32_t min_lc;
+	for (i = 0; i < NUM_SERVERS; i++)
+	{
+		min_lc = processed[i];
+		for (j = 0; j < NUM_SERVERS; j++)
+			if (current_session.lamport_counters[j][i] < min_lc)
+				min_lc = current_session.lamport_counters[j][i];
+		retire_log_segments(i + 1, min_lc);
+	}
+}
+
+// restores the session from the snapshot file, if there is a valid one.
+// returns 1 if a snapshot was loaded
+static int load_snapshot()
+{
+	u_int32_t size, offset = 0, magic = 0, version = 0, message_size = 0, num_of_chatrooms = 0, length, num_of_likers;
+	u_int32_t window_size, num_of_messages, appends_since_rebalance;
+	u_int32_t lamport_counter, lamport_counters[NUM_SERVERS][NUM_SERVERS], processed[NUM_SERVERS];
+	char name[20], username[20];
+	int i, j, k, index;
+	Chatroom *c;
+	char *buffer = read_snapshot_file(current_session.server_id, &size);
+	if (buffer == NULL)
+	{
+		log_info("no snapshot found. rebuilding the session from the chatroom and log files");
+		return 0;
+	}
+	snapshot_get(buffer, size, &offset, &magic, 4);
+	snapshot_get(buffer, size, &offset, &version, 4);
+	snapshot_get(buffer, size, &offset, &message_size, 4);
+	if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION || message_size != sizeof(MessageHeader) + sizeof(MessageText) ||
+		!snapshot_get(buffer, size, &offset, &lamport_counter, 4) ||
+		!snapshot_get(buffer, size, &offset, lamport_counters, sizeof(lamport_counters)) ||
+		!snapshot_get(buffer, size, &offset, processed, sizeof(processed)) ||
+		!snapshot_get(buffer, size, &offset, &appends_since_rebalance, 4) ||
+		!snapshot_get(buffer, size, &offset, &num_of_chatrooms, 4))
+	{
+		log_error("ignoring invalid snapshot file");
+		free(buffer);
+		return 0;
+	}
+	for (i = 0; i < num_of_chatrooms; i++)
+	{
+		if (!snapshot_get(buffer, size, &offset, name, sizeof(name)))
+			goto corrupt;
+		name[sizeof(name) - 1] = 0;
+		index = create_new_chatroom(name, 1);
+		c = &current_session.chatrooms[index];
+		if (!snapshot_get(buffer, size, &offset, &window_size, 4) ||
+			!snapshot_get(buffer, size, &offset, &c->activity, 4) ||
+			!snapshot_get(buffer, size, &offset, &num_of_messages, 4) ||
+			!snapshot_get(buffer, size, &offset, &c->num_of_archived, 4) ||
+			window_size == 0 || window_size > WINDOW_LIMIT || num_of_messages > window_size)
+			goto corrupt;
+		// keep the window the chatroom had, the next rebalance adjusts it to the current configuration
+		c->window_size = window_size;
+		if (num_of_messages)
+			resize_message_ring(c, num_of_messages);
+		for (j = 0; j < num_of_messages; j++)
+		{
+			if (!snapshot_get(buffer, size, &offset, &c->headers[j], sizeof(MessageHeader)) ||
+				!snapshot_get(buffer, size, &offset, &c->texts[j], sizeof(MessageText)) ||
+				!snapshot_get(buffer, size, &offset, &num_of_likers, 4) ||
+				c->headers[j].username_length > sizeof(c->texts[j].username) || c->headers[j].message_length > sizeof(c->texts[j].message))
+				goto corrupt;
+			c->num_of_messages++;
+			c->headers[j].num_of_likers = 0;
+			set_message_location(c, c->headers[j].server_id, c->headers[j].lamport_counter, 0, j);
+			for (k = 0; k < num_of_likers; k++)
+			{
+				if (!snapshot_get(buffer, size, &offset, &length, 4) || length >= sizeof(username) ||
+					!snapshot_get(buffer, size, &offset, username, length))
+					goto corrupt;
+				username[length] = 0;
+				if (id_set_insert(&c->likers[j], intern_username(username)))
+					c->headers[j].num_of_likers++;
+			}
+		}
+	}
+	current_session.lamport_counter = lamport_counter;
+	memcpy(current_session.lamport_counters, lamport_counters, sizeof(lamport_counters));
+	memcpy(current_session.processed_lamport_counters, processed, sizeof(processed));
+	window_config.appends_since_rebalance = appends_since_rebalance;
+	log_info("loaded snapshot of %d chatrooms, processed lts = %d %d %d %d %d", num_of_chatrooms,
+			 processed[0], processed[1], processed[2], processed[3], processed[4]);
+	free(buffer);
+	return 1;
+
+corrupt:
+	// drop whatever was restored and rebuild from the files instead
+	log_error("snapshot file is truncated or corrupt. ignoring it");
+	for (i = 0; i < current_session.num_of_chatrooms; i++)
+		free_chatroom(&current_session.chatrooms[i]);
+	reset_chatroom_indexes();
+	free(buffer);
+	return 0;
 }
 
 // initialize the server data on startup
@@ -464,13 +815,15 @@ static int initialize()
 	int fds[5];
 	char server_group_name[10];
 	log_info("Server Initializing");
+	current_session.disk_fd = start_disk_writer();
 	create_log_files(current_session.server_id, 5, RECREATE_FILES_IN_STARTUP, fds);
 
 	current_session.connected_clients = 0;
-	current_session.num_of_chatrooms = 0;
+	reset_chatroom_indexes();
 	current_session.unprocessed_updates_count = 0;
 	current_session.state = STATE_PRIMARY;
 	current_session.unprocessed_update_start = NULL;
+	current_session.num_of_dirty = 0;
 
 	for (i = 0; i < NUM_SERVERS; i++)
 	{
@@ -481,9 +834,10 @@ static int initialize()
 			current_session.lamport_counters[i][j] = 0;
 		}
 	}
+	load_snapshot();
 	create_chatroom_from_files();
 	update_chatroom_data_based_on_log_files();
-	current_session.clients = hashmap_new();
+	name_map_init(&current_session.clients);
 	log_info("Joining servers group");
 	ret = SP_join(Mbox, "chat_servers");
 	if (ret < 0)
@@ -498,106 +852,298 @@ static int initialize()
 }
 
 
+// multicasts the message written in <w> to <group> and releases <w>. a message that did not fit is dropped
+static int send_to_group(char *group, wireWriter *w)
+{
+	if (wire_writer_ok(w))
+		SP_multicast(Mbox, AGREED_MESS, group, 2, wire_size(w), wire_message(w));
+	else
+		log_error("dropping a message to %s that does not fit in a message", group);
+	wire_writer_release(w);
+	return 0;
+}
+
 // A generic function to send message of type <type> to servers group
-// It appends a 1-byte <type> and 4-byte <server id> to the start of the <payload> and sends it to all servers
-static int send_to_servers(char type, char *payload, u_int32_t size)
+// It prepends a 1-byte <type> and 4-byte <server id> to the payload written in <w> and sends it to all servers
+// the batched log records go out first, so the servers get our messages in the order we sent them
+static int send_to_servers(char type, wireWriter *w)
 {
-	char *serversGroup = "chat_servers";
-	char message[size + 5];
-	message[0] = type;
+	if (type != TYPE_SERVER_UPDATE_BATCH)
+		Flush_server_updates(0, NULL);
 	log_debug("sending message type %c to servers", type);
-	memcpy(message + 1, &current_session.server_id, 4);
-	memcpy(message + 5, payload, size);
-	SP_multicast(Mbox, AGREED_MESS, serversGroup, 2, size + 5, message);
+	wire_prepend_u32(w, current_session.server_id);
+	wire_prepend_u8(w, type);
+	return send_to_group("chat_servers", w);
+}
+
+// whether <id> is a participant of chatroom <c> through a server other than <server_index>
+static int connected_elsewhere(Chatroom *c, int server_index, u_int32_t id)
+{
+	int i;
+	for (i = 0; i < NUM_SERVERS; i++)
+		if (i != server_index && id_set_contains(&c->participants[i], id))
+			return 1;
 	return 0;
 }
 
-// iterates over NUM_SERVERS list of participants for chatroom <index> and appends all participants to <agg> as the output of the function
-static int aggregate_participants(hash_set_st *agg, int index)
+// adds <id> to the participants of chatroom <c> connected to server <server_index> (0 based).
+// returns 1 if <id> is new to the union of all servers
+static int add_participant(Chatroom *c, int server_index, u_int32_t id)
 {
-	int i, j, count = 0;
-	hash_set_it *it;
-	char *username;
-	for (i = 0; i < 5; i++)
+	if (!id_set_insert(&c->participants[server_index], id))
+		return 0;
+	return id_set_insert(&c->all_participants, id);
+}
+
+// removes <id> from the participants of chatroom <c> connected to server <server_index>.
+// returns 1 if <id> left the union, i.e. no other server has it
+static int remove_participant(Chatroom *c, int server_index, u_int32_t id)
+{
+	if (!id_set_remove(&c->participants[server_index], id))
+		return 0;
+	if (connected_elsewhere(c, server_index, id))
+		return 0;
+	id_set_remove(&c->all_participants, id);
+	return 1;
+}
+
+// removes all the participants of chatroom <c> connected to server <server_index>.
+// returns the number of participants that left the union
+static int clear_participants(Chatroom *c, int server_index)
+{
+	u_int32_t position = 0, id;
+	int left = 0;
+	while (id_set_next(&c->participants[server_index], &position, &id))
+		if (!connected_elsewhere(c, server_index, id))
+		{
+			id_set_remove(&c->all_participants, id);
+			left++;
+		}
+	id_set_clear(&c->participants[server_index]);
+	return left;
+}
+
+// Clients are kept up to date with deltas: every change of a chatroom that clients see is queued as a delta,
+// and once per event loop pass the deltas of each changed chatroom are multicast together as one
+// TYPE_CLIENT_DELTA carrying the new version of the chatroom. When the queued deltas would be bigger than the
+// full state (a burst of likes, a replay of the logs) or after bulk changes (a server leaving), the chatroom
+// gets one full TYPE_CLIENT_UPDATE instead. A full update is also sent to a client that joins the chatroom or
+// finds a gap in the versions (TYPE_RESYNC).
+
+// writes the message in slot <slot> of chatroom <c> as clients read it: LTS, username, text and number of likes
+// (at most CLIENT_MESSAGE_MAX_SIZE bytes)
+static void put_client_message(wireWriter *w, Chatroom *c, u_int32_t slot)
+{
+	MessageHeader *header = &c->headers[slot];
+	MessageText *text = &c->texts[slot];
+	log_debug("message size is %d, LTS = %d,%d, likers = %d", header->message_length, header->server_id, header->lamport_counter, header->num_of_likers);
+	wire_write_u32(w, header->server_id);
+	wire_write_u32(w, header->lamport_counter);
+	wire_write_string(w, text->username, header->username_length);
+	wire_write_string(w, text->message, header->message_length);
+	wire_write_u32(w, header->num_of_likers);
+}
+
+// writes the full state of chatroom <index>:
+// its version, the participants of all servers and the last CLIENT_UPDATE_MESSAGES messages with their likes
+static void build_chatroom_update(int index, wireWriter *w)
+{
+	Chatroom *c = &current_session.chatrooms[index];
+	idSet *participants = &c->all_participants;
+	const char *username;
+	u_int32_t num_of_messages, position, id, count, i;
+	wire_write_u8(w, TYPE_CLIENT_UPDATE);
+	wire_write_u32(w, c->version);
+	wire_write_u32(w, participants->count);
+	position = 0;
+	while (id_set_next(participants, &position, &id))
+	{
+		username = get_username(id);
+		wire_write_string(w, username, strlen(username));
+	}
+
+	// clients only get the most recent messages of the window
+	num_of_messages = c->num_of_messages < CLIENT_UPDATE_MESSAGES ? c->num_of_messages : CLIENT_UPDATE_MESSAGES;
+	wire_write_u32(w, num_of_messages);
+	log_debug("message start pointer is %d and we have %d messages", c->message_start_pointer, c->num_of_messages);
+	i = c->capacity ? (c->message_start_pointer + c->num_of_messages - num_of_messages) % c->capacity : 0;
+	for (count = 0; count < num_of_messages; count++)
 	{
-		it = it_init(&current_session.chatrooms[index].participants[i]);
-		for (j = 0; j < current_session.chatrooms[index].num_of_participants[i]; j++)
+		put_client_message(w, c, i);
+		if (++i == c->capacity)
+			i = 0;
+	}
+	log_debug("client update for chatroom %s (version %d) has %d participants and %d messages", c->name, c->version, participants->count, num_of_messages);
+}
+
+// largest full update of chatroom <index>
+static u_int32_t client_update_size(int index)
+{
+	return 13 + current_session.chatrooms[index].all_participants.count * (4 + USERNAME_MAX_LENGTH) + CLIENT_UPDATE_MESSAGES * CLIENT_MESSAGE_MAX_SIZE;
+}
+
+// sends the full state of chatroom <index> to every client in it, as a new version
+static int send_chatroom_update_to_clients(int index)
+{
+	char chatroomGroup[MAX_GROUP_NAME];
+	wireWriter w;
+	current_session.chatrooms[index].version++;
+	wire_writer_init(&w);
+	build_chatroom_update(index, &w);
+	sprintf(chatroomGroup, "CHATROOM_%s_%d", current_session.chatrooms[index].name, current_session.server_id);
+	log_debug("sending client update for chatroom %s to %s", current_session.chatrooms[index].name, chatroomGroup);
+	return send_to_group(chatroomGroup, &w);
+}
+
+// multicasts the queued deltas of chatroom <index> to its clients as one new version
+static int send_chatroom_deltas(int index)
+{
+	char chatroomGroup[MAX_GROUP_NAME];
+	Chatroom *c = &current_session.chatrooms[index];
+	wireWriter w;
+	c->version++;
+	wire_writer_init(&w);
+	wire_write_u8(&w, TYPE_CLIENT_DELTA);
+	wire_write_u32(&w, c->version);
+	wire_write_u32(&w, c->num_of_pending);
+	wire_write_bytes(&w, c->pending_deltas, c->pending_size);
+	sprintf(chatroomGroup, "CHATROOM_%s_%d", c->name, current_session.server_id);
+	log_debug("sending %d deltas (version %d) for chatroom %s", c->num_of_pending, c->version, c->name);
+	return send_to_group(chatroomGroup, &w);
+}
+
+// records that chatroom <index> owes its clients an update of kind <dirty> (a full update supersedes the deltas)
+static void mark_chatroom_dirty(int index, u_int32_t dirty)
+{
+	Chatroom *c = &current_session.chatrooms[index];
+	if (c->dirty == CLIENTS_UP_TO_DATE)
+	{
+		if (current_session.num_of_dirty == current_session.dirty_capacity)
 		{
-			username = (char *)it_value(it);
-			hash_set_insert(agg, username, strlen(username));
-			count++;
-			it_next(it);
+			current_session.dirty_capacity = current_session.dirty_capacity ? current_session.dirty_capacity * 2 : 64;
+			current_session.dirty_chatrooms = (u_int32_t *)realloc(current_session.dirty_chatrooms, current_session.dirty_capacity * 4);
 		}
+		current_session.dirty_chatrooms[current_session.num_of_dirty++] = index;
 	}
-	log_debug("Aggregated participants for chatroom index %d - total participants = %d", index, count);
-	return count;
-}
-
-// we call this whenever we want to send an update to the chatroom to clients through server's exclusive group for that chatroom
-// - it inputs the name and index of the chatroom
-// - aggregates the chatroom participants
-// - gathers last 25 messages
-// - aggregates the number of likes per message
-// - sends the created payload to the chatroom group
-static int send_chatroom_update_to_clients(char *chatroom, int index)
-{
-	int j;
-	char chatroomGroup[30];
-	char message[1400];
-	char *username;
-	log_debug("send_chatroom_update_to_clients %s", chatroom);
-	hash_set_st *participants = hash_set_init(chksum);
-	hash_set_it *it;
-	u_int32_t num_participants, username_size;
-	int offset = 5;
-	message[0] = TYPE_CLIENT_UPDATE;
-	sprintf(chatroomGroup, "CHATROOM_%s_%d", chatroom, current_session.server_id);
-	num_participants = aggregate_participants(participants, index);
-	memcpy(message + 1, &num_participants, 4);
-	it = it_init(participants);
-	for (j = 0; j < num_participants; j++)
-	{
-		username = (char *)it_value(it);
-		u_int32_t uname_size = strlen(username);
-		memcpy(message + offset, &uname_size, 4);
-		memcpy(message + offset + 4, username, uname_size);
-		offset += (4 + uname_size);
-		it_next(it);
-	}
-
-	memcpy(message + offset, &current_session.chatrooms[index].num_of_messages, 4);
-	offset += 4;
-	int i, count = 0;
-	log_debug("message start pointer is %d and we have %d messages", current_session.chatrooms[index].message_start_pointer, current_session.chatrooms[index].num_of_messages);
-	i = current_session.chatrooms[index].message_start_pointer;
-	while(count < current_session.chatrooms[index].num_of_messages)
+	if (dirty > c->dirty)
+		c->dirty = dirty;
+	if (c->dirty == CLIENTS_NEED_FULL_UPDATE)
 	{
-	
-		u_int32_t message_size = strlen(current_session.chatrooms[index].messages[i].message);
-		log_debug("message size is %d, LTS = %d,%d", message_size, current_session.chatrooms[index].messages[i].serverID, current_session.chatrooms[index].messages[i].lamportCounter);
-		memcpy(message + offset, &current_session.chatrooms[index].messages[i].serverID, 4);
-		memcpy(message + offset + 4, &current_session.chatrooms[index].messages[i].lamportCounter, 4);
-		//
-		username_size = strlen(current_session.chatrooms[index].messages[i].userName);
-		memcpy(message + offset + 8, &username_size, 4);
-		memcpy(message + offset + 12, &current_session.chatrooms[index].messages[i].userName, username_size);
-		current_session.chatrooms[index].messages[i].userName[username_size] = 0;
-		//
-		offset += (12 + username_size);
-		memcpy(message + offset, &message_size, 4);
-		memcpy(message + offset + 4, current_session.chatrooms[index].messages[i].message, message_size);
-		log_debug("message is %s", current_session.chatrooms[index].messages[i].message);
-		log_debug("message likers = %d", current_session.chatrooms[index].num_of_likers[i]);
-		memcpy(message + offset + 4 + message_size, &current_session.chatrooms[index].num_of_likers[i], 4);
-		offset += (8 + message_size);
-		i++;
-		count++;
-		if(i == 25)
-		    i = 0;
-	}
-	log_debug("sending client update for chatroom %s with %d participants and %d messages", chatroom, num_participants, current_session.chatrooms[index].num_of_messages);
-	SP_multicast(Mbox, AGREED_MESS, chatroomGroup, 2, offset + 5, message);
-	return 0;
+		c->pending_size = 0;
+		c->num_of_pending = 0;
+	}
+}
+
+// queues the change <delta_type> described by <payload> for the clients of chatroom <index>.
+// once the queued deltas outgrow the full state of the chatroom, the full state is sent instead
+static void queue_chatroom_delta(int index, char delta_type, char *payload, u_int32_t size)
+{
+	Chatroom *c = &current_session.chatrooms[index];
+	if (c->dirty == CLIENTS_NEED_FULL_UPDATE)
+		return;
+	if (c->pending_size + 1 + size > client_update_size(index))
+	{
+		log_debug("deltas of chatroom %s outgrew its full state", c->name);
+		mark_chatroom_dirty(index, CLIENTS_NEED_FULL_UPDATE);
+		return;
+	}
+	if (c->pending_size + 1 + size > c->pending_capacity)
+	{
+		c->pending_capacity = client_update_size(index);
+		c->pending_deltas = (char *)realloc(c->pending_deltas, c->pending_capacity);
+	}
+	c->pending_deltas[c->pending_size] = delta_type;
+	memcpy(c->pending_deltas + c->pending_size + 1, payload, size);
+	c->pending_size += 1 + size;
+	c->num_of_pending++;
+	mark_chatroom_dirty(index, CLIENTS_NEED_DELTAS);
+}
+
+// sends what chatroom <index> owes its clients, if anything
+static void flush_chatroom_updates(int index)
+{
+	Chatroom *c = &current_session.chatrooms[index];
+	if (c->dirty == CLIENTS_NEED_FULL_UPDATE)
+		send_chatroom_update_to_clients(index);
+	else if (c->dirty == CLIENTS_NEED_DELTAS)
+		send_chatroom_deltas(index);
+	c->dirty = CLIENTS_UP_TO_DATE;
+	c->pending_size = 0;
+	c->num_of_pending = 0;
+}
+
+// sends every changed chatroom its update. called at the end of each event loop pass,
+// so a chatroom gets at most one multicast however many changes the pass made to it
+static void flush_client_updates()
+{
+	u_int32_t i;
+	for (i = 0; i < current_session.num_of_dirty; i++)
+		flush_chatroom_updates(current_session.dirty_chatrooms[i]);
+	current_session.num_of_dirty = 0;
+}
+
+// sends the full state of chatroom <index> to the client <username> only (on join and on resync requests).
+// the queued deltas go out first so the version of the state matches the deltas that follow it
+static int send_chatroom_update_to_client(char *username, int index)
+{
+	char clientGroup[MAX_GROUP_NAME];
+	wireWriter w;
+	flush_chatroom_updates(index);
+	wire_writer_init(&w);
+	build_chatroom_update(index, &w);
+	sprintf(clientGroup, "%s_%d", username, current_session.server_id);
+	log_debug("sending client update for chatroom %s to %s", current_session.chatrooms[index].name, clientGroup);
+	return send_to_group(clientGroup, &w);
+}
+
+// a message was appended to slot <slot> of chatroom <index>.
+// the delta also tells clients how many of the latest messages they should keep
+static void queue_message_delta(int index, u_int32_t slot)
+{
+	char payload[CLIENT_MESSAGE_MAX_SIZE + 4];
+	Chatroom *c = &current_session.chatrooms[index];
+	wireWriter w;
+	wire_writer_init_buffer(&w, payload, sizeof(payload));
+	put_client_message(&w, c, slot);
+	wire_write_u32(&w, c->num_of_messages < CLIENT_UPDATE_MESSAGES ? c->num_of_messages : CLIENT_UPDATE_MESSAGES);
+	queue_chatroom_delta(index, DELTA_MESSAGE, payload, wire_size(&w));
+}
+
+// the likes of message <pid>, <counter> of chatroom <index> changed.
+// nothing is sent for archived messages since clients only show the in-memory ones
+static void queue_likes_delta(int index, u_int32_t pid, u_int32_t counter)
+{
+	char payload[12];
+	Chatroom *c = &current_session.chatrooms[index];
+	MessageLocation *location = find_message_location(c, pid, counter);
+	wireWriter w;
+	if (location == NULL || location->archived)
+		return;
+	wire_writer_init_buffer(&w, payload, sizeof(payload));
+	wire_write_u32(&w, pid);
+	wire_write_u32(&w, counter);
+	wire_write_u32(&w, c->headers[location->position].num_of_likers);
+	queue_chatroom_delta(index, DELTA_LIKES, payload, wire_size(&w));
+}
+
+// participant <id> joined (<joined> = 1) or left chatroom <index>
+static void queue_participant_delta(int index, u_int32_t id, int joined)
+{
+	char payload[4 + USERNAME_MAX_LENGTH];
+	const char *username = get_username(id);
+	wireWriter w;
+	wire_writer_init_buffer(&w, payload, sizeof(payload));
+	wire_write_string(&w, username, strlen(username));
+	queue_chatroom_delta(index, joined ? DELTA_PARTICIPANT_JOINED : DELTA_PARTICIPANT_LEFT, payload, wire_size(&w));
+}
+
+// starts reading the request <message> of a client: skips its type and copies the username of the client to <username>.
+// returns 0 if the username does not fit
+static int read_client_request(wireReader *r, char *message, u_int32_t size, char *username)
+{
+	wire_reader_init(r, message, size);
+	wire_read_u8(r);
+	return wire_string_copy(wire_read_string(r), username, USERNAME_MAX_LENGTH);
 }
 
 // handle client connection message
@@ -605,13 +1151,15 @@ static int send_chatroom_update_to_clients(char *chatroom, int index)
 // parses the usernamefrom the message and creates a group between the server and the client to support unicasts and connection/disconnection events
 static int handle_connect(char *message, u_int32_t size)
 {
-	u_int32_t username_size;
+	wireReader r;
 	int ret;
 	char username[20];
-	char group_name[30];
-	memcpy(&username_size, message + 1, 4);
-	memcpy(username, message + 5, username_size);
-	username[username_size] = 0;
+	char group_name[MAX_GROUP_NAME];
+	if (!read_client_request(&r, message, size, username))
+	{
+		log_error("invalid connection request");
+		return 0;
+	}
 	sprintf(group_name, "%s_%d", username, current_session.server_id);
 	log_info("Handling client connection %s by joining %s", username, group_name);
 	ret = SP_join(Mbox, group_name);
@@ -622,20 +1170,76 @@ static int handle_connect(char *message, u_int32_t size)
 }
 
 // inputs the name of the chatroom and returns the unique index of that chatroom
-// possibly the most used utility function in our app!
+// possibly the most used utility function in our app! (a hash lookup on the name)
 static int find_chatroom_index(char *chatroom)
 {
-	int i;
-	for (i = 0; i < current_session.num_of_chatrooms; i++)
-		if (!strcmp(current_session.chatrooms[i].name, chatroom))
-		{
-			log_debug("chatroom index for %s is %d", chatroom, i);
-			return i;
-		}
+	int32_t index;
+	if (name_map_get(&current_session.chatroom_indexes, chatroom, &index))
+	{
+		log_debug("chatroom index for %s is %d", chatroom, index);
+		return index;
+	}
 	log_debug("chatroom index for %s not found", chatroom);
 	return -1;
 }
 
+// forgets every chatroom: empties the name index and the chatroom list
+static void reset_chatroom_indexes()
+{
+	name_map_free(&current_session.chatroom_indexes);
+	current_session.num_of_chatrooms = 0;
+}
+
+static u_int32_t hash_lts(u_int32_t server_id, u_int32_t lamport_counter)
+{
+	return (lamport_counter * 2654435761u) ^ server_id;
+}
+
+// returns the location of message <server_id>, <lamport_counter> in chatroom <c>, or NULL if it is unknown
+static MessageLocation *find_message_location(Chatroom *c, u_int32_t server_id, u_int32_t lamport_counter)
+{
+	u_int32_t i;
+	if (c->locations_capacity == 0)
+		return NULL;
+	for (i = hash_lts(server_id, lamport_counter) & (c->locations_capacity - 1); c->locations[i].server_id; i = (i + 1) & (c->locations_capacity - 1))
+	{
+		if (c->locations[i].server_id == server_id && c->locations[i].lamport_counter == lamport_counter)
+			return &c->locations[i];
+	}
+	return NULL;
+}
+
+// adds or moves message <server_id>, <lamport_counter> of chatroom <c>
+static void set_message_location(Chatroom *c, u_int32_t server_id, u_int32_t lamport_counter, u_int32_t archived, u_int32_t position)
+{
+	MessageLocation *location, *old = c->locations;
+	u_int32_t i, old_capacity = c->locations_capacity;
+	if (server_id == 0)
+		return;
+	location = find_message_location(c, server_id, lamport_counter);
+	if (location == NULL)
+	{
+		// keep the table at most half full
+		if ((c->num_of_locations + 1) * 2 > c->locations_capacity)
+		{
+			c->locations_capacity = old_capacity ? old_capacity * 2 : 64;
+			c->locations = (MessageLocation *)calloc(c->locations_capacity, sizeof(MessageLocation));
+			c->num_of_locations = 0;
+			for (i = 0; i < old_capacity; i++)
+				if (old[i].server_id)
+					set_message_location(c, old[i].server_id, old[i].lamport_counter, old[i].archived, old[i].position);
+			free(old);
+		}
+		for (i = hash_lts(server_id, lamport_counter) & (c->locations_capacity - 1); c->locations[i].server_id; i = (i + 1) & (c->locations_capacity - 1));
+		location = &c->locations[i];
+		location->server_id = server_id;
+		location->lamport_counter = lamport_counter;
+		c->num_of_locations++;
+	}
+	location->archived = archived;
+	location->position = position;
+}
+
 // create a new chatroom and its data structures
 // if <no_create_file> is set, do not create chatroom file
 // This function is called when:
@@ -647,55 +1251,80 @@ static int create_new_chatroom(char *chatroom, int no_create_file)
 	int i;
 	int index = current_session.num_of_chatrooms;
 	log_info("Creating data structures for new chatroom %s", chatroom);
+	if (index == current_session.chatrooms_capacity)
+	{
+		current_session.chatrooms_capacity = current_session.chatrooms_capacity ? current_session.chatrooms_capacity * 2 : 64;
+		current_session.chatrooms = (Chatroom *)realloc(current_session.chatrooms, current_session.chatrooms_capacity * sizeof(Chatroom));
+	}
 	current_session.num_of_chatrooms++;
+	// the ring slots are filled without terminators, so they must start zeroed
+	memset(&current_session.chatrooms[index], 0, sizeof(Chatroom));
 	strcpy(current_session.chatrooms[index].name, chatroom);
-	current_session.chatrooms[index].num_of_messages = 0;
-	current_session.chatrooms[index].message_start_pointer = 0;
+	name_map_put(&current_session.chatroom_indexes, chatroom, index);
+	// everything else, including the ring (allocated as messages arrive), starts zeroed
+	current_session.chatrooms[index].window_size = window_config.min_size;
+	current_session.chatrooms[index].dirty = CLIENTS_UP_TO_DATE;
 	for (i = 0; i < NUM_SERVERS; i++)
-	{
-		current_session.chatrooms[index].participants[i] = *hash_set_init(chksum);
-		current_session.chatrooms[index].num_of_participants[i] = 0;
-	}
-	for(i=0; i < 25;i++)
-	{
-		current_session.chatrooms[index].likers[i] = *hash_set_init(chksum);
-		current_session.chatrooms[index].num_of_likers[i] = 0;
-	}
+		id_set_init(&current_session.chatrooms[index].participants[i]);
+	id_set_init(&current_session.chatrooms[index].all_participants);
 	if(!no_create_file)
 		create_chatroom_file(current_session.server_id, chatroom, RECREATE_FILES_IN_STARTUP);
 	return index;
 }
 
+// releases the memory of chatroom <c>: its participant and liker sets, the ring slab, the location index and the queued deltas
+static void free_chatroom(Chatroom *c)
+{
+	u_int32_t i;
+	for (i = 0; i < NUM_SERVERS; i++)
+		id_set_clear(&c->participants[i]);
+	id_set_clear(&c->all_participants);
+	for (i = 0; i < c->capacity; i++)
+		id_set_clear(&c->likers[i]);
+	free(c->slab);
+	free(c->locations);
+	free(c->archive_tail);
+	c->slab = NULL;
+	c->archive_tail = NULL;
+	c->archive_skip = 0;
+	c->headers = NULL;
+	c->texts = NULL;
+	c->likers = NULL;
+	c->capacity = 0;
+	c->num_of_messages = 0;
+	c->locations = NULL;
+	c->locations_capacity = 0;
+	c->num_of_locations = 0;
+	free(c->pending_deltas);
+	c->pending_deltas = NULL;
+	c->pending_size = 0;
+	c->pending_capacity = 0;
+	c->num_of_pending = 0;
+}
+
 // called whenever a participant change occures in chatroom <chatroom> with index <index>
 //	The username is the joined/left participant
 static int send_participant_change_to_servers(char *chatroom, char *username, int index)
 {
-	char payload[1300];
-	u_int32_t offset, nop;
-	u_int32_t chatroom_length = strlen(chatroom);
-	hash_set_it *it;
-	memcpy(payload, &chatroom_length, 4);
-	memcpy(payload + 4, chatroom, chatroom_length);
-	offset = 4 + chatroom_length;
-	int i, j;
+	u_int32_t nop, position, id;
+	const char *participant;
+	wireWriter w;
+	int i;
+	wire_writer_init(&w);
+	wire_write_string(&w, chatroom, strlen(chatroom));
 	for (i = 0; i < 5; i++)
 	{
-		nop = current_session.chatrooms[index].num_of_participants[i];
+		nop = current_session.chatrooms[index].participants[i].count;
 		log_debug("Server %d #participants %d", i + 1, nop);
-		memcpy(payload + offset, &nop, 4);
-		offset += 4;
-		it = it_init(&current_session.chatrooms[index].participants[i]);
-		for (j = 0; j < nop; j++)
+		wire_write_u32(&w, nop);
+		position = 0;
+		while (id_set_next(&current_session.chatrooms[index].participants[i], &position, &id))
 		{
-			username = (char *)it_value(it);
-			u_int32_t uname_size = strlen(username);
-			memcpy(payload + offset, &uname_size, 4);
-			memcpy(payload + offset + 4, username, uname_size);
-			offset += (4 + uname_size);
-			it_next(it);
+			participant = get_username(id);
+			wire_write_string(&w, participant, strlen(participant));
 		}
 	}
-	send_to_servers(TYPE_PARTICIPANT_UPDATE, payload, offset + 4 + chatroom_length);
+	send_to_servers(TYPE_PARTICIPANT_UPDATE, &w);
 	return 0;
 }
 
@@ -707,65 +1336,104 @@ static int send_participant_change_to_servers(char *chatroom, char *username, in
 // send a client update back to the client
 static int handle_join(char *message, int size)
 {
-	u_int32_t username_length, chatroom_length;
+	u_int32_t id;
 	char chatroom[20];
-	char *username;
-	int32_t chatroom_index, ret;
-	int32_t *old_idx = (int32_t *)malloc(sizeof(int32_t));
-	username = (char *)calloc(20, 1);
-	memcpy(&username_length, message + 1, 4);
-	memcpy(username, message + 5, username_length);
-	memcpy(&chatroom_length, message + 5 + username_length, 4);
-	memcpy(chatroom, message + 9 + username_length, chatroom_length);
-	chatroom[chatroom_length] = 0;
-	username[username_length] = 0;
-	log_debug("Handling client join request username = %s, chatroom length = %d, chatroom = %s, old chatroom = %d", username, chatroom_length, chatroom, *old_idx);
-	ret = hashmap_get(current_session.clients, username, (void **)(&old_idx));
-	if (ret == MAP_OK)
-	{
-		u_int32_t length, count;
-		log_debug("client was previously in chatroom index %d", *old_idx);
-		length = current_session.chatrooms[*old_idx].num_of_participants[current_session.server_id - 1];
-		count = hash_set_remove(&current_session.chatrooms[*old_idx].participants[current_session.server_id - 1], length, username);
-		current_session.chatrooms[*old_idx].num_of_participants[current_session.server_id - 1] = count;
-		send_participant_change_to_servers(current_session.chatrooms[*old_idx].name, username, *old_idx);
-		send_chatroom_update_to_clients(current_session.chatrooms[*old_idx].name, *old_idx);
+	char username[20];
+	int32_t chatroom_index, old_idx;
+	wireReader r;
+	if (!read_client_request(&r, message, size, username) || !wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid join request");
+		return 0;
 	}
-	else
+	id = intern_username(username);
+	log_debug("Handling client join request username = %s, chatroom = %s", username, chatroom);
+	if (name_map_get(&current_session.clients, username, &old_idx))
 	{
-		free(old_idx);
-		old_idx = (int32_t *)malloc(sizeof(int32_t));
+		log_debug("client was previously in chatroom index %d", old_idx);
+		if (remove_participant(&current_session.chatrooms[old_idx], current_session.server_id - 1, id))
+			queue_participant_delta(old_idx, id, 0);
+		send_participant_change_to_servers(current_session.chatrooms[old_idx].name, username, old_idx);
 	}
 	chatroom_index = find_chatroom_index(chatroom);
 	if (chatroom_index == -1)
 		chatroom_index = create_new_chatroom(chatroom, 0);
 
-	hash_set_insert(&current_session.chatrooms[chatroom_index].participants[current_session.server_id - 1], username, strlen(username));
-	current_session.chatrooms[chatroom_index].num_of_participants[current_session.server_id - 1]++;
-	*old_idx = chatroom_index;
-	ret = hashmap_put(current_session.clients, username, old_idx);
-
-	if (ret != MAP_OK)
-		log_error("Error in putting client to my map");
+	if (add_participant(&current_session.chatrooms[chatroom_index], current_session.server_id - 1, id))
+		queue_participant_delta(chatroom_index, id, 1);
+	name_map_put(&current_session.clients, username, chatroom_index);
 
 	send_participant_change_to_servers(chatroom, username, chatroom_index);
-	send_chatroom_update_to_clients(chatroom, chatroom_index);
+	// the joining client starts from the full state of the chatroom
+	send_chatroom_update_to_client(username, chatroom_index);
+	return 0;
+}
+
+// sends the batched log records to the servers as one TYPE_SERVER_UPDATE_BATCH.
+// runs as a timer once the oldest record in the batch has waited SERVER_UPDATE_BATCH_DELAY, and whenever
+// the batch is full or another message is sent to the servers
+static void Flush_server_updates(int code, void *data)
+{
+	ServerUpdateBatch *batch = &server_update_batch;
+	if (batch->timer_queued)
+	{
+		E_dequeue(Flush_server_updates, 0, NULL);
+		batch->timer_queued = 0;
+	}
+	if (batch->num_of_records == 0)
+		return;
+	memcpy(batch->count, &batch->num_of_records, 4);
+	log_debug("sending %d log records (%d bytes) to servers", batch->num_of_records, batch->size);
+	batch->num_of_records = 0;
+	batch->size = 0;
+	send_to_servers(TYPE_SERVER_UPDATE_BATCH, &batch->writer);
+}
+
+// This is wher we notify the servers of a new record in our log file
+// <server id> is the server who has a new update
+// we only attach the server id to the binary log record and add it to the batch of records sent together
+static int send_log_update_to_servers(u_int32_t server_id, u_int32_t record_length, char *record)
+{
+	ServerUpdateBatch *batch = &server_update_batch;
+	sp_time delay;
+	if (batch->size + 8 + record_length > SERVER_UPDATE_BATCH_SIZE)
+		Flush_server_updates(0, NULL);
+	if (batch->num_of_records == 0)
+	{
+		wire_writer_init(&batch->writer);
+		batch->count = wire_reserve(&batch->writer, 4);
+	}
+	wire_write_u32(&batch->writer, server_id);
+	wire_write_string(&batch->writer, record, record_length);
+	batch->size += 8 + record_length;
+	batch->num_of_records++;
+	log_debug("batched log record of length %d (of server %d) for servers", record_length, server_id);
+	if (!batch->timer_queued)
+	{
+		delay.sec = 0;
+		delay.usec = SERVER_UPDATE_BATCH_DELAY;
+		E_queue(Flush_server_updates, 0, NULL, delay);
+		batch->timer_queued = 1;
+	}
 	return 0;
 }
 
-// This is wher we notify the servers of a new line in our log file
-// <server id> is the server who has a new update
-// we only attach the server id to the line and send it
-static int send_log_update_to_servers(u_int32_t server_id, u_int32_t line_length, char *line)
-{
-	u_int32_t size = 0;
-	size += (8 + line_length);
-	char payload[size];
-	memcpy(payload, &server_id, 4);
-	memcpy(payload + 4, &line_length, 4);
-	memcpy(payload + 8, line, line_length);
-	log_debug("sending log line to servers %s", line);
-	send_to_servers(TYPE_SERVER_UPDATE, payload, size);
+static void send_committed_log_update(void *arg)
+{
+	PendingLogUpdate *update = (PendingLogUpdate *)arg;
+	send_log_update_to_servers(update->server_id, update->record_length, update->record);
+	free(update);
+}
+
+// notifies the servers of a new record in our log once the record is committed,
+// so the other servers never learn about an update we could lose in a crash
+static int send_log_update_after_commit(u_int32_t server_id, u_int32_t record_length, char *record)
+{
+	PendingLogUpdate *update = (PendingLogUpdate *)malloc(sizeof(PendingLogUpdate));
+	update->server_id = server_id;
+	update->record_length = record_length;
+	memcpy(update->record, record, record_length);
+	after_log_commit(send_committed_log_update, update);
 	return 0;
 }
 
@@ -776,20 +1444,25 @@ static int send_log_update_to_servers(u_int32_t server_id, u_int32_t line_length
 // - otherwise, parse the message, create a log line, store it in the log and then send an update to all servers and also to the client
 static int handle_append(char *message, int msg_size)
 {
-	u_int32_t username_length, chatroom_length, payload_length, offset;
-	u_int32_t size = 0;
-	char username[20], chatroom[20], payload[80];
+	u_int32_t record_length;
+	char username[20], chatroom[20];
 	int chatroom_index;
 	logEvent e;
-	// print_hex(message, 100);
+	wireReader r;
+	wireString payload;
 	memset(&e, 0, sizeof(e));
-	memset(payload, 0, 80);
-	memcpy(&username_length, message + 1, 4);
-	memcpy(username, message + 5, username_length);
-	memcpy(&chatroom_length, message + 5 + username_length, 4);
-	memcpy(chatroom, message + 9 + username_length, chatroom_length);
-	chatroom[chatroom_length] = 0;
-	username[username_length] = 0;
+	if (!read_client_request(&r, message, msg_size, username) || !wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid append request");
+		return 0;
+	}
+	// the text stays in the received message
+	payload = wire_read_string(&r);
+	if (!wire_reader_ok(&r) || payload.length >= sizeof(((MessageText *)0)->message))
+	{
+		log_error("invalid append request from %s: the message does not fit", username);
+		return 0;
+	}
 	log_debug("handling append message from %s in chatroom %s", username, chatroom);
 	if(current_session.state == STATE_RECONCILING)
 	{
@@ -805,139 +1478,260 @@ static int handle_append(char *message, int msg_size)
 		log_fatal("chatroom not found. This should not happen, right???????");
 		return 0;
 	}
-	offset = username_length + chatroom_length + 9;
-	log_debug("attempting to read payload length from message");
-	memcpy(&payload_length, message + offset, 4);
-	log_debug(" payload length is %d", payload_length);
-	memcpy(payload, message + offset + 4, payload_length);
-	log_debug(" payload is %s", payload);
-	payload[payload_length] = 0;
 	e.eventType = TYPE_APPEND;
 	e.lamportCounter = ++current_session.lamport_counter;
 	current_session.lamport_counters[current_session.server_id - 1][current_session.server_id - 1] = current_session.lamport_counter;
-	char line[100];
-	sprintf(line, "%s~%s", username, payload);
-	memcpy(e.payload, line, payload_length + username_length + 1);
-	memcpy(e.chatroom, chatroom, chatroom_length);
-	log_debug("event log payload for append is %s", line);
-	size += (13 + strlen(e.payload));
-	char buffer[size];
-	createLogLine(current_session.server_id, e, buffer);
-	addEventToLogFile(current_session.server_id, buffer);
-	send_log_update_to_servers(current_session.server_id, strlen(buffer), buffer);
-
-	update_chatroom_data(chatroom_index, chatroom, username, payload_length, payload, e, current_session.server_id, 0);
+	set_append_payload(&e, username, payload.data, payload.length);
+	strcpy(e.chatroom, chatroom);
+	char record[LOG_RECORD_MAX_SIZE];
+	record_length = encode_log_record(&e, record);
+	addEventToLogFile(current_session.server_id, &e);
+	send_log_update_after_commit(current_session.server_id, record_length, record);
+
+	update_chatroom_data(chatroom_index, chatroom, username, payload.length, payload.data, e, current_session.server_id, 0);
+	mark_event_processed(current_session.server_id, e.lamportCounter);
 
 	return 0;
 }
 
-// this function updates the chatroom data structures with new data received
-// the new data is stored in the chatroom data structures and then an update is sent to all parties
-// if we have 25 messages in memory, we need to transfer the pldest one to the chatroom file first
-// this function is called with <dump> = 0 when we are reading the chatroom data from the file and only want to reflect LTS data
-static void update_chatroom_data(int chatroom_index, char *chatroom, char *username, u_int32_t payload_length, char *payload, logEvent e, u_int32_t serverID, int dump)
+// reallocates the message ring of chatroom <c> with <capacity> slots (at least its number of messages).
+// the messages are moved to the start of the new ring, oldest first
+static void resize_message_ring(Chatroom *c, u_int32_t capacity)
 {
-	u_int32_t msg_pointer;
-	int i, offset = 0;
-	hash_set_it *it;
-	char *liker_username;
-	if (current_session.chatrooms[chatroom_index].num_of_messages < 25)
+	// one allocation per ring: the likers come first since idSet has the strictest alignment
+	char *slab = (char *)calloc(capacity, RING_SLOT_SIZE);
+	idSet *likers = (idSet *)slab;
+	MessageHeader *headers = (MessageHeader *)(likers + capacity);
+	MessageText *texts = (MessageText *)(headers + capacity);
+	u_int32_t i, slot;
+	log_debug("resizing the message ring of chatroom %s from %d to %d slots", c->name, c->capacity, capacity);
+	for (i = 0, slot = c->message_start_pointer; i < c->num_of_messages; i++, slot = (slot + 1) % c->capacity)
 	{
-		msg_pointer = current_session.chatrooms[chatroom_index].num_of_messages;
-		log_debug("before adding to messages, chatroom %s had %d message(s)", chatroom, msg_pointer);
-		current_session.chatrooms[chatroom_index].num_of_messages++;
+		headers[i] = c->headers[slot];
+		texts[i] = c->texts[slot];
+		likers[i] = c->likers[slot];
+		set_message_location(c, headers[i].server_id, headers[i].lamport_counter, 0, i);
 	}
-	else
+	free(c->slab);
+	c->slab = slab;
+	c->headers = headers;
+	c->texts = texts;
+	c->likers = likers;
+	c->capacity = capacity;
+	c->message_start_pointer = 0;
+}
+
+// returns the chatroom file line of message <server_id>, <lamport_counter> of chatroom <c> if it was
+// archived before the restart and is evicted again by the log replay, -1 if it still has to be written
+static int take_archived_line(Chatroom *c, u_int32_t server_id, u_int32_t lamport_counter)
+{
+	u_int32_t i;
+	if (c->archive_skip == 0)
+		return -1;
+	// the evictions are replayed in the order they were written, so the match is usually the first line left
+	for (i = c->archive_tail_next; i < c->archive_tail_length; i++)
 	{
-		msg_pointer = current_session.chatrooms[chatroom_index].message_start_pointer;
-		if(!dump)
-		{
-			Message m = current_session.chatrooms[chatroom_index].messages[msg_pointer];
-			log_debug("moving message #%d, %d to file", m.serverID, m.lamportCounter);
-			it = it_init(&current_session.chatrooms[chatroom_index].likers[msg_pointer]);
-			memset(m.additionalInfo, 0, 200);
-			for(i = 0; i < current_session.chatrooms[chatroom_index].num_of_likers[msg_pointer];i++){
-				liker_username = (char *)it_value(it);
-				memcpy(m.additionalInfo + offset, liker_username, strlen(liker_username));
-				m.additionalInfo[offset + strlen(liker_username)] = ',';
-				offset += (1 + strlen(liker_username));
-				it_next(it);
-			}
-			hash_set_clear(&current_session.chatrooms[chatroom_index].likers[msg_pointer]);
-			addMessageToChatroomFile(current_session.server_id, chatroom, m);
-			memset(&current_session.chatrooms[chatroom_index].messages[msg_pointer], 0, sizeof(Message));
+		if (c->archive_tail[i].serverID == server_id && c->archive_tail[i].lamportCounter == lamport_counter)
+			break;
+	}
+	if (i == c->archive_tail_length)
+	{
+		log_warn("message %d, %d of %s is not in the chatroom file yet", server_id, lamport_counter, c->name);
+		return -1;
+	}
+	c->archive_tail[i].serverID = 0;	// matched
+	while (c->archive_tail_next < c->archive_tail_length && c->archive_tail[c->archive_tail_next].serverID == 0)
+		c->archive_tail_next++;
+	if (--c->archive_skip == 0)
+	{
+		free(c->archive_tail);
+		c->archive_tail = NULL;
+	}
+	return c->archive_tail_start + i;
+}
+
+// removes the oldest in-memory message of chatroom <chatroom_index>.
+// unless <dump> is set, it is written to the chatroom file with its likers first
+static void remove_oldest_message(int chatroom_index, int dump)
+{
+	Chatroom *c = &current_session.chatrooms[chatroom_index];
+	u_int32_t slot = c->message_start_pointer, position, id;
+	int offset = 0, line;
+	const char *liker_username;
+	if(!dump)
+	{
+		Message m;
+		memset(&m, 0, sizeof(Message));
+		m.serverID = c->headers[slot].server_id;
+		m.lamportCounter = c->headers[slot].lamport_counter;
+		memcpy(m.userName, c->texts[slot].username, c->headers[slot].username_length);
+		memcpy(m.message, c->texts[slot].message, c->headers[slot].message_length);
+		log_debug("moving message #%d, %d to file", m.serverID, m.lamportCounter);
+		position = 0;
+		while(id_set_next(&c->likers[slot], &position, &id)){
+			liker_username = get_username(id);
+			memcpy(m.additionalInfo + offset, liker_username, strlen(liker_username));
+			m.additionalInfo[offset + strlen(liker_username)] = ',';
+			offset += (1 + strlen(liker_username));
 		}
-		current_session.chatrooms[chatroom_index].message_start_pointer++;
-		if (current_session.chatrooms[chatroom_index].message_start_pointer == 25)
+		line = take_archived_line(c, m.serverID, m.lamportCounter);
+		if (line == -1)
 		{
-			current_session.chatrooms[chatroom_index].message_start_pointer = 0;
+			// the message is the next line of the chatroom file (after the lines not evicted again yet)
+			addMessageToChatroomFile(current_session.server_id, c->name, m);
+			line = c->num_of_archived + c->archive_skip;
 		}
+		set_message_location(c, m.serverID, m.lamportCounter, 1, line);
+		c->num_of_archived++;
 	}
-	log_debug("adding new message to slot %d in memory", msg_pointer);
-	memcpy(current_session.chatrooms[chatroom_index].messages[msg_pointer].message, payload, payload_length);
-	memcpy(current_session.chatrooms[chatroom_index].messages[msg_pointer].userName, username, strlen(username));
-	current_session.chatrooms[chatroom_index].messages[msg_pointer].userName[strlen(username)] = 0;
+	id_set_clear(&c->likers[slot]);
+	memset(&c->headers[slot], 0, sizeof(MessageHeader));
+	c->message_start_pointer = (slot + 1) % c->capacity;
+	c->num_of_messages--;
+}
+
+// sets the window of chatroom <chatroom_index>, moving the messages that no longer fit to the chatroom file
+static void set_message_window(int chatroom_index, u_int32_t window_size)
+{
+	Chatroom *c = &current_session.chatrooms[chatroom_index];
+	if (window_size == c->window_size)
+		return;
+	log_debug("window of chatroom %s: %d -> %d messages", c->name, c->window_size, window_size);
+	if (c->num_of_messages > window_size)
+	{
+		while (c->num_of_messages > window_size)
+			remove_oldest_message(chatroom_index, 0);
+		// clients lost messages they were showing
+		if (window_size < CLIENT_UPDATE_MESSAGES)
+			mark_chatroom_dirty(chatroom_index, CLIENTS_NEED_FULL_UPDATE);
+	}
+	c->window_size = window_size;
+	if (c->capacity > window_size)
+		resize_message_ring(c, window_size);
+}
+
+// shares the memory budget out between the chatroom windows:
+// every chatroom gets the minimum window, the rest goes to the chatrooms in proportion to their recent appends
+static void rebalance_message_windows()
+{
+	u_int64_t budget_slots = window_config.budget / RING_SLOT_SIZE, spare = 0, total_activity = 0, window_size;
+	int i;
+	window_config.appends_since_rebalance = 0;
+	if (budget_slots > (u_int64_t)current_session.num_of_chatrooms * window_config.min_size)
+		spare = budget_slots - (u_int64_t)current_session.num_of_chatrooms * window_config.min_size;
+	for (i = 0; i < current_session.num_of_chatrooms; i++)
+		total_activity += current_session.chatrooms[i].activity;
+	for (i = 0; i < current_session.num_of_chatrooms; i++)
+	{
+		window_size = window_config.min_size;
+		if (total_activity)
+			window_size += spare * current_session.chatrooms[i].activity / total_activity;
+		if (window_size > window_config.max_size)
+			window_size = window_config.max_size;
+		set_message_window(i, window_size);
+		current_session.chatrooms[i].activity /= 2;
+	}
+	log_info("rebalanced the message windows of %d chatrooms (budget %llu messages)", current_session.num_of_chatrooms, (unsigned long long)budget_slots);
+}
 
-	current_session.chatrooms[chatroom_index].messages[msg_pointer].numOfLikes = 0;
-	current_session.chatrooms[chatroom_index].messages[msg_pointer].lamportCounter = e.lamportCounter;
-	current_session.chatrooms[chatroom_index].messages[msg_pointer].serverID = serverID;
+// this function updates the chatroom data structures with new data received
+// the new data is stored in the chatroom data structures and then an update is sent to all parties
+// if the window of the chatroom is full, we need to transfer the oldest message to the chatroom file first
+// this function is called with <dump> = 0 when we are reading the chatroom data from the file and only want to reflect LTS data
+static void update_chatroom_data(int chatroom_index, char *chatroom, char *username, u_int32_t payload_length, const char *payload, logEvent e, u_int32_t serverID, int dump)
+{
+	Chatroom *c = &current_session.chatrooms[chatroom_index];
+	MessageHeader *header;
+	MessageText *text;
+	u_int32_t msg_pointer, capacity;
+	if (c->num_of_messages == c->window_size)
+		remove_oldest_message(chatroom_index, dump);
+	if (c->num_of_messages == c->capacity)
+	{
+		// the ring grows with the chatroom, up to its window
+		capacity = c->capacity ? c->capacity * 2 : 4;
+		resize_message_ring(c, capacity < c->window_size ? capacity : c->window_size);
+	}
+	msg_pointer = (c->message_start_pointer + c->num_of_messages) % c->capacity;
+	log_debug("before adding to messages, chatroom %s had %d message(s)", chatroom, c->num_of_messages);
+	c->num_of_messages++;
+	c->activity++;
+	log_debug("adding new message to slot %d in memory", msg_pointer);
+	header = &c->headers[msg_pointer];
+	text = &c->texts[msg_pointer];
+	header->message_length = payload_length < sizeof(text->message) ? payload_length : sizeof(text->message);
+	header->username_length = strlen(username) < sizeof(text->username) ? strlen(username) : sizeof(text->username) - 1;
+	memcpy(text->message, payload, header->message_length);
+	memcpy(text->username, username, header->username_length);
+
+	header->num_of_likers = 0;
+	header->lamport_counter = e.lamportCounter;
+	header->server_id = serverID;
+	set_message_location(c, serverID, e.lamportCounter, 0, msg_pointer);
 
 	if(!dump)
-		send_chatroom_update_to_clients(chatroom, chatroom_index);
+		queue_message_delta(chatroom_index, msg_pointer);
+
+	// the log replay after a restart rebalances too: the snapshot keeps the rebalance state, so it evicts the same messages
+	if (!dump && ++window_config.appends_since_rebalance >= WINDOW_REBALANCE_INTERVAL)
+		rebalance_message_windows();
 }
 
 // Apply client like to the message
 // inputs <chatroom_index> LTS of the message and the username of the liker
-// the username is added to the likers hashset
-// NOTE: if message is not in the memory, we have a correct design to find the line in the chatroom file and update it
-// 		  however, we didn't have time to do it now.
+// the message is found through the LTS index of the chatroom: if it is in memory the username is added to its likers,
+// if it was moved to the chatroom file the like is journaled against its line
+// returns 1 if the like was applied, -1 if the user already liked the message and 0 if the message is unknown
 static int apply_like(u_int32_t chatroom_index, u_int32_t pid, u_int32_t counter, char *username)
 {
-	int i, hashset_result;
-	for(i = 0; i < current_session.chatrooms[chatroom_index].num_of_messages; i++)
+	Chatroom *c = &current_session.chatrooms[chatroom_index];
+	MessageLocation *location = find_message_location(c, pid, counter);
+	if (location == NULL)
 	{
-		if(current_session.chatrooms[chatroom_index].messages[i].serverID == pid &&
-			current_session.chatrooms[chatroom_index].messages[i].lamportCounter == counter)
-		{
-			log_debug("applying like on %d, %d for chatroom %d, liker = %s", pid, counter, chatroom_index, username);
-			hashset_result = hash_set_insert(&current_session.chatrooms[chatroom_index].likers[i], username, strlen(username));
-			if(hashset_result == OK){
-				current_session.chatrooms[chatroom_index].num_of_likers[i]++;
-				log_debug("num of likers for that message = %d", current_session.chatrooms[chatroom_index].num_of_likers[i]);
-				return 1;
-			}
-			log_debug("liker insert failed = %d", hashset_result);
-			return -1;
-		}
-	}
-		log_info("The message to be liked is not in memory. So we need to find it in the chatroom file and update it");
+		log_warn("message %d, %d to be liked is not in chatroom %s", pid, counter, c->name);
 		return 0;
+	}
+	log_debug("applying like on %d, %d for chatroom %d, liker = %s", pid, counter, chatroom_index, username);
+	if (location->archived)
+	{
+		addLikeToChatroomFile(current_session.server_id, c->name, location->position, pid, counter, TYPE_LIKE, username);
+		return 1;
+	}
+	if (id_set_insert(&c->likers[location->position], intern_username(username)))
+	{
+		c->headers[location->position].num_of_likers++;
+		log_debug("num of likers for that message = %d", c->headers[location->position].num_of_likers);
+		return 1;
+	}
+	log_debug("%s already likes the message", username);
+	return -1;
 }
 
 // Apply client unlike to the message
 // inputs <chatroom_index> LTS of the message and the username of the unliker
-// the username is remove to the likers hashset
-// NOTE: if message is not in the memory, we have a correct design to find the line in the chatroom file and update it
-// 		  however, we didn't have time to do it now.
+// like apply_like, the username is removed from the likers in memory or the unlike is journaled for an archived message
+// returns 1 if the unlike was applied and 0 if the message is unknown
 static int apply_unlike(u_int32_t chatroom_index, u_int32_t pid, u_int32_t counter, char *username)
 {
-	int i, hashset_result, flag = 0;
-	u_int32_t length;
-	for(i = 0; i < current_session.chatrooms[chatroom_index].num_of_messages; i++)
+	Chatroom *c = &current_session.chatrooms[chatroom_index];
+	MessageLocation *location = find_message_location(c, pid, counter);
+	u_int32_t id;
+	if (location == NULL)
 	{
-		if(current_session.chatrooms[chatroom_index].messages[i].serverID == pid &&
-			current_session.chatrooms[chatroom_index].messages[i].lamportCounter == counter)
-		{
-			log_debug("applying unlike on %d, %d for chatroom %d, liker = %s", pid, counter, chatroom_index, username);
-			length = current_session.chatrooms[chatroom_index].num_of_likers[i];
-			hashset_result = hash_set_remove(&current_session.chatrooms[chatroom_index].likers[i], length, username);
-			log_debug("num of likers for that message = %d", hashset_result);
-			current_session.chatrooms[chatroom_index].num_of_likers[i] = hashset_result;
-			return 1;
-		}
+		log_warn("message %d, %d to be unliked is not in chatroom %s", pid, counter, c->name);
+		return 0;
+	}
+	log_debug("applying unlike on %d, %d for chatroom %d, liker = %s", pid, counter, chatroom_index, username);
+	if (location->archived)
+	{
+		addLikeToChatroomFile(current_session.server_id, c->name, location->position, pid, counter, TYPE_UNLIKE, username);
+		return 1;
 	}
-	log_info("The message to be unliked is not in memory. So we need to find it in the chatroom file and update it");
-	return flag;
+	if (find_username_id(username, &id))
+		id_set_remove(&c->likers[location->position], id);
+	c->headers[location->position].num_of_likers = c->likers[location->position].count;
+	log_debug("num of likers for that message = %d", c->headers[location->position].num_of_likers);
+	return 1;
 }
 
 // handle the like/unlike message from the client
@@ -945,33 +1739,34 @@ static int apply_unlike(u_int32_t chatroom_index, u_int32_t pid, u_int32_t count
 // we find the chatoom index. create the log line and update the log file
 // if we are in reconciliation (we store the log) in a temporary list
 // otherwise, we reflect thelike/unlike in our data.
-static int handle_like_unlike(char *message, char event_type)
+static int handle_like_unlike(char *message, int size)
 {
 
-	u_int32_t username_length, chatroom_length, offset;
-	u_int32_t size = 0;
+	u_int32_t record_length;
 	logEvent e;
-	int chatroom_index;
+	int chatroom_index, applied;
 	char username[20], chatroom[20];
+	char event_type = message[0];
 	u_int32_t pid, counter;
-	char line[100];
+	wireReader r;
 	memset(&e, 0, sizeof(e));
-	memset(username,0, 20);
-	memset(chatroom,0, 20);
-	memcpy(&username_length, message + 1, 4);
-	log_debug(" username length is %d", username_length);
-	memcpy(username, message + 5, username_length);
-	log_debug(" liker is %s", username);
-	memcpy(&chatroom_length, message + 5 + username_length, 4);
-	log_debug(" c-length is %d", chatroom_length);
-	memcpy(chatroom, message + 9 + username_length, chatroom_length);
-	log_debug(" chatroom is %s", chatroom);
-	username[username_length] = 0;
-	chatroom[chatroom_length] = 0;
+	if (!read_client_request(&r, message, size, username) || !wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid like/unlike request");
+		return 0;
+	}
+	pid = wire_read_u32(&r);
+	counter = wire_read_u32(&r);
+	if (!wire_reader_ok(&r))
+	{
+		log_error("invalid like/unlike request from %s", username);
+		return 0;
+	}
+	log_debug("liker is %s, chatroom is %s", username, chatroom);
 	if(current_session.state == STATE_RECONCILING)
 	{
 		log_warn("in the midst of reconciling. appending to a temporary list to process later. list length before append is %d", current_session.unprocessed_updates_count);
-		push(current_session.unprocessed_update_start, message, strlen(message));
+		push(current_session.unprocessed_update_start, message, size);
 		current_session.unprocessed_updates_count++;
 		return 0;
 	}
@@ -981,84 +1776,101 @@ static int handle_like_unlike(char *message, char event_type)
 		log_fatal("chatroom not found. This should not happen, right???????");
 		return 0;
 	}
-	offset = username_length + chatroom_length + 9;
-	memcpy(&pid, message + offset, 4);
-	memcpy(&counter, message + offset + 4, 4);
 	log_debug("handling like/unlike for message #%d, %d from %s", pid, counter, username);
 	e.eventType = event_type;
 	e.lamportCounter = ++current_session.lamport_counter;
 	current_session.lamport_counters[current_session.server_id - 1][current_session.server_id - 1] = current_session.lamport_counter;
-	sprintf(line, "%s~%d~%d", username, pid, counter);
-	log_debug("like/unlike log payload is: %s", line);
-	memcpy(e.payload, line, strlen(line));
-	memcpy(e.chatroom, chatroom, chatroom_length);
-	size += (13 + strlen(e.payload));
-	char buffer[size];
-	createLogLine(current_session.server_id, e, buffer);
-	addEventToLogFile(current_session.server_id, buffer);
+	set_like_payload(&e, username, pid, counter);
+	strcpy(e.chatroom, chatroom);
+	char record[LOG_RECORD_MAX_SIZE];
+	record_length = encode_log_record(&e, record);
+	addEventToLogFile(current_session.server_id, &e);
 	////
 	// updating data structures
 	if(event_type == TYPE_LIKE)
-		apply_like(chatroom_index, pid, counter, username);
+		applied = apply_like(chatroom_index, pid, counter, username);
 	else{
-		apply_unlike(chatroom_index, pid, counter, username);
+		applied = apply_unlike(chatroom_index, pid, counter, username);
 	}
+	mark_event_processed(current_session.server_id, e.lamportCounter);
 	//
-	send_log_update_to_servers(current_session.server_id, strlen(buffer), buffer);
-	send_chatroom_update_to_clients(chatroom, chatroom_index);
+	send_log_update_after_commit(current_session.server_id, record_length, record);
+	if (applied == 1)
+		queue_likes_delta(chatroom_index, pid, counter);
 	return 0;
 }
 
-// send a history of the chatroom to the clients
-// this message is directly unicast to client and does not contain likes in current version
-static int send_history_response(char *username, char *chatroom)
+// the archived messages of a history request were read: send the archived messages followed by the in-memory ones
+static void send_pending_history(void *arg)
 {
-	int i;	
-	char clientGroup[30];
-	u_int32_t index = find_chatroom_index(chatroom);
-	char response[102400];
-	u_int32_t num_of_messages, offset = 5;
-	u_int32_t message_size, username_size;
-	Message messages[MAX_HISTORY_MESSAGES];
-	memset(messages, 0, MAX_HISTORY_MESSAGES * sizeof(Message));
-	retrieve_chatroom_history(current_session.server_id, chatroom, &num_of_messages, messages);
-	// TODO: parse additional info and get number of likers
-
-	for(i = 0; i < current_session.chatrooms[index].num_of_messages;i++)
-	{
-		messages[num_of_messages].serverID = current_session.chatrooms[index].messages[i].serverID;
-		messages[num_of_messages].lamportCounter = current_session.chatrooms[index].messages[i].lamportCounter;
-		messages[num_of_messages].numOfLikes = current_session.chatrooms[index].num_of_likers[i];
-		memcpy(messages[num_of_messages].userName, current_session.chatrooms[index].messages[i].userName, strlen(current_session.chatrooms[index].messages[i].userName));
-		memcpy(messages[num_of_messages].message, current_session.chatrooms[index].messages[i].message, strlen(current_session.chatrooms[index].messages[i].message));
-		num_of_messages++;
-	}
-
-	response[0] = TYPE_HISTORY_RESPONSE;
-    memcpy(response + 1, &num_of_messages, 4);
-	sprintf(clientGroup, "%s_%d", username, current_session.server_id);
+	PendingHistory *history = (PendingHistory *)arg;
+	int i;
+	char clientGroup[MAX_GROUP_NAME];
+	u_int32_t num_of_messages = history->num_of_archived + history->num_of_recent;
+	Message *message;
+	wireWriter w;
+
+	wire_writer_init(&w);
+	wire_write_u8(&w, TYPE_HISTORY_RESPONSE);
+	wire_write_u32(&w, num_of_messages);
+	sprintf(clientGroup, "%s_%d", history->username, current_session.server_id);
 
 	for (i = 0; i < num_of_messages; i++)
 	{
-		message_size = strlen(messages[i].message);
-		log_debug("message size is %d", message_size);
-		memcpy(response + offset, &messages[i].serverID, 4);
-		memcpy(response + offset + 4, &messages[i].lamportCounter, 4);
-		//
-		username_size = strlen(messages[i].userName);
-		memcpy(response + offset + 8, &username_size, 4);
-		memcpy(response + offset + 12, &messages[i].userName, username_size);
-		//
-		offset += (12 + username_size);
-		memcpy(response + offset, &message_size, 4);
-		memcpy(response + offset + 4, current_session.chatrooms[index].messages[i].message, message_size);
-		log_debug("message is %s", messages[i].message);
-		memcpy(response + offset + 4 + message_size, &messages[i].numOfLikes, 4);
-		log_debug("num of likes is %d", messages[i].numOfLikes);
-		offset += (8 + message_size);
+		message = i < history->num_of_archived ? &history->archived[i] : &history->recent[i - history->num_of_archived];
+		log_debug("message is %s, num of likes is %d", message->message, message->numOfLikes);
+		wire_write_u32(&w, message->serverID);
+		wire_write_u32(&w, message->lamportCounter);
+		wire_write_string(&w, message->userName, strlen(message->userName));
+		wire_write_string(&w, message->message, strlen(message->message));
+		wire_write_u32(&w, message->numOfLikes);
 	}
 	log_debug("sending history response to group %s with %d messages ", clientGroup, num_of_messages);
-	SP_multicast(Mbox, AGREED_MESS, clientGroup, 2, offset + 5, response);
+	send_to_group(clientGroup, &w);
+	free(history);
+}
+
+// send a history of the chatroom to the clients
+// this message is directly unicast to client and does not contain likes in current version
+// the in-memory messages are copied right away; the response goes out once the disk thread has read the archived ones
+static int send_history_response(char *username, char *chatroom)
+{
+	int i, slot, num_of_messages;
+	int index = find_chatroom_index(chatroom);
+	PendingHistory *history;
+	MessageHeader *header;
+	MessageText *text;
+	Message *message;
+	if (index == -1)
+	{
+		log_error("history requested for unknown chatroom %s", chatroom);
+		return 0;
+	}
+	history = (PendingHistory *)calloc(1, sizeof(PendingHistory));
+	strcpy(history->username, username);
+
+	// the window can hold more than a history response, so only the most recent messages are taken from it
+	num_of_messages = current_session.chatrooms[index].num_of_messages;
+	if (num_of_messages > MAX_HISTORY_MESSAGES)
+		num_of_messages = MAX_HISTORY_MESSAGES;
+	slot = current_session.chatrooms[index].capacity ? (current_session.chatrooms[index].message_start_pointer +
+		current_session.chatrooms[index].num_of_messages - num_of_messages) % current_session.chatrooms[index].capacity : 0;
+	for(i = 0; i < num_of_messages;i++)
+	{
+		message = &history->recent[history->num_of_recent++];
+		header = &current_session.chatrooms[index].headers[slot];
+		text = &current_session.chatrooms[index].texts[slot];
+		message->serverID = header->server_id;
+		message->lamportCounter = header->lamport_counter;
+		message->numOfLikes = header->num_of_likers;
+		memcpy(message->userName, text->username, header->username_length);
+		memcpy(message->message, text->message, header->message_length);
+		if(++slot == current_session.chatrooms[index].capacity)
+			slot = 0;
+	}
+	// the archive provides whatever the in-memory messages leave room for
+	retrieve_chatroom_history(current_session.server_id, chatroom, MAX_HISTORY_MESSAGES - history->num_of_recent, &history->num_of_archived, history->archived,
+		send_pending_history, history);
     return 0;    
 }
 
@@ -1066,51 +1878,68 @@ static int send_history_response(char *username, char *chatroom)
 // parse the chatroom name and call the above function to build a response
 static int handle_history(char *message, u_int32_t size)
 {
-    u_int32_t username_length, chatroom_length;
-	u_int32_t offset = 5;
 	char username[20], chatroom[20];
+	wireReader r;
 
-	memcpy(&username_length, message + 1, 4);
-	memcpy(username, message + 5, username_length);
-	username[username_length] = 0;
-	offset += username_length;
-	memcpy(&chatroom_length, message + offset, 4);
-	memcpy(chatroom, message + offset + 4, chatroom_length);
-	chatroom[chatroom_length] = 0;
+	if (!read_client_request(&r, message, size, username) || !wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid history request");
+		return 0;
+	}
 	log_debug("handling history message from %s for chatroom %s", username, chatroom);
 	
 	send_history_response(username, chatroom);
 	return 0;
 }
 
+// handle the resync request of a client that missed a delta of its chatroom: send it the full state
+static int handle_resync(char *message, u_int32_t size)
+{
+	char username[20], chatroom[20];
+	int index;
+	wireReader r;
+
+	if (!read_client_request(&r, message, size, username) || !wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid resync request");
+		return 0;
+	}
+	log_debug("handling resync request from %s for chatroom %s", username, chatroom);
+	index = find_chatroom_index(chatroom);
+	if (index == -1)
+	{
+		log_error("resync requested for unknown chatroom %s", chatroom);
+		return 0;
+	}
+	send_chatroom_update_to_client(username, index);
+	return 0;
+}
+
 // handle the "v" message from clients
 // we parse the username to be able to unicast it back to the client.
 // the response is an array of NUM_SERVERS integers either 1 or 0. They show the current membership of each server in current server's membership group.
 static int handle_membership_status(char *message, int msg_size)
 {
 	int i;
-	char clientGroup[30];
-	char response[NUM_SERVERS*4+5];
-    u_int32_t username_length;	
+	char clientGroup[MAX_GROUP_NAME];
 	char username[20];
-    int offset = 5;
-    u_int32_t num_servers;
+	wireReader r;
+	wireWriter w;
 
-	memcpy(&username_length, message + 1, 4);
-	memcpy(username, message + 5, username_length);
-	username[username_length] = 0;
+	if (!read_client_request(&r, message, msg_size, username))
+	{
+		log_error("invalid membership status request");
+		return 0;
+	}
 	log_debug("handling membership status message from %s", username);
-	num_servers = NUM_SERVERS;
-	response[0] = TYPE_MEMBERSHIP_STATUS_RESPONSE;
-    memcpy(response + 1, &num_servers, 4);
+	wire_writer_init(&w);
+	wire_write_u8(&w, TYPE_MEMBERSHIP_STATUS_RESPONSE);
+	wire_write_u32(&w, NUM_SERVERS);
 	sprintf(clientGroup, "%s_%d", username, current_session.server_id);
 	for (i = 0; i < NUM_SERVERS; i++)
-	{
-		memcpy(response + offset, &current_session.membership[i], 4);
-		offset += 4;
-	}
+		wire_write_u32(&w, current_session.membership[i]);
 	log_debug("sending membership status response: %d %d %d %d %d ", current_session.membership[0],current_session.membership[1],current_session.membership[2],current_session.membership[3],current_session.membership[4]);
-	SP_multicast(Mbox, AGREED_MESS, clientGroup, 2, offset + 5, response);	
+	send_to_group(clientGroup, &w);
 	return 0;
 }
 
@@ -1131,11 +1960,21 @@ static int log_remaining(u_int32_t startup)
 	return 0;
 }
 
+// records that the log event <lamport_counter> of <server_id> is reflected in the chatroom data
+// and takes a snapshot every SNAPSHOT_INTERVAL events
+static void mark_event_processed(u_int32_t server_id, u_int32_t lamport_counter)
+{
+	log_debug("setting processed lts to %d, %d ", server_id, lamport_counter);
+	current_session.processed_lamport_counters[server_id - 1] = lamport_counter;
+	if (++current_session.events_since_snapshot >= SNAPSHOT_INTERVAL)
+		write_snapshot();
+}
+
 // gets logevent <e> from log file <server_id>, and decides how to process it.
 // it might be an append, like, or an unlike message
 static int process_log_event(logEvent e, u_int32_t server_id)
 {
-	u_int32_t chatroom_index, pid, counter;
+	u_int32_t chatroom_index, pid, counter, message_length;
 	char username[20], message_text[80];
 	chatroom_index = find_chatroom_index(e.chatroom);
     if(chatroom_index == -1){
@@ -1144,143 +1983,329 @@ static int process_log_event(logEvent e, u_int32_t server_id)
 	switch (e.eventType)
 	{
 	case TYPE_APPEND:
-		sscanf(e.payload, "%[^\n\t~]~%[^\n\t]", username, message_text);
-		log_debug("parsing append data {%s} from message. username = %s, message text = %s, chatroom = %s", e.payload, username, message_text, e.chatroom);
-		update_chatroom_data(chatroom_index, e.chatroom, username, strlen(message_text), message_text, e, server_id, 0);
+		if (!get_append_payload(&e, username, message_text, &message_length))
+		{
+			log_error("malformed append %d of server %d in chatroom %s", e.lamportCounter, server_id, e.chatroom);
+			break;
+		}
+		log_debug("parsing append data from message. username = %s, message text = %.*s, chatroom = %s", username, (int)message_length, message_text, e.chatroom);
+		update_chatroom_data(chatroom_index, e.chatroom, username, message_length, message_text, e, server_id, 0);
 		break;
 	case TYPE_LIKE:
-		sscanf(e.payload, "%[^~]~%d~%d", username, &pid, &counter);
-		apply_like(chatroom_index, pid, counter, username);
-		send_chatroom_update_to_clients(e.chatroom, chatroom_index);
-		break;
 	case TYPE_UNLIKE:
-		sscanf(e.payload, "%[^~]~%d~%d", username, &pid, &counter);
-		apply_unlike(chatroom_index, pid, counter, username);
-		send_chatroom_update_to_clients(e.chatroom, chatroom_index);
+		if (!get_like_payload(&e, username, &pid, &counter))
+		{
+			log_error("malformed like/unlike %d of server %d in chatroom %s", e.lamportCounter, server_id, e.chatroom);
+			break;
+		}
+		if ((e.eventType == TYPE_LIKE ? apply_like(chatroom_index, pid, counter, username) : apply_unlike(chatroom_index, pid, counter, username)) == 1)
+			queue_likes_delta(chatroom_index, pid, counter);
 		break;
 	default:
 		log_error("Invalid event type %c", e.eventType);
 		break;
 	}
-	log_debug("setting processed lts to %d, %d ", server_id, e.lamportCounter);
-	current_session.processed_lamport_counters[server_id - 1] = e.lamportCounter;
 	if(e.lamportCounter > current_session.lamport_counters[current_session.server_id - 1][server_id - 1]){
 		current_session.lamport_counters[current_session.server_id - 1][server_id - 1] = e.lamportCounter;
 		current_session.lamport_counter = e.lamportCounter;
 	}
-	
+	mark_event_processed(server_id, e.lamportCounter);
 	return 0;
 }
 
-// a utility function that tries to detect when we have finished traversing all log files
-static int log_line_available(u_int32_t *data_available)
+// This function is called in startup to process the log files and update the chatroom data (return_to_primary does it after reconciliation).
+// it streams the log files through a k-way merge in (lamport counter, server id) order, starting after the last processed record of each file.
+// The servers and clients will be notified after each line is processed
+static int process_log_files(u_int32_t startup)
 {
-	int i;
-	for(i =0;i < NUM_SERVERS;i++)
+	logMerge merge;
+	logEvent e;
+	u_int32_t server_id;
+    log_debug("processing log files");
+	// in startup the log files are read on the recovery threads before merging
+	open_log_merge(&merge, NUM_SERVERS, current_session.processed_lamport_counters, startup ? get_recovery_threads() : 1);
+	while(log_remaining(startup) && next_merged_log_event(&merge, &e, &server_id) == LOG_MERGE_EVENT)
 	{
-		if(data_available[i])
-			return 1;
+        log_debug("next log record is for server %d with lc %d", server_id, e.lamportCounter);
+		process_log_event(e, server_id);
 	}
-	return 0;
+	close_log_merge(&merge);
+    return 0;
 }
 
-// This function is called in startup or after reconciliation to process the log files and update the chatroom data.
-// it will read log updates line by line and process them.
-// The servers and clients will be notified after each line is processed
-static int process_log_files(u_int32_t startup)
+// leaves the reconciling state once the log records received meanwhile are processed.
+// they are read on the disk thread a chunk at a time, client updates keep being queued until then
+static void return_to_primary()
 {
-	logEvent e[NUM_SERVERS];
-	u_int32_t data_available[NUM_SERVERS];
-	u_int32_t min_lc = -1, min_server_id = 0;
-	int i;
-    log_debug("processing log files");
-	while(log_remaining(startup))
+	if (current_session.returning_to_primary)
+		return;
+	log_info("returning to primary state");
+	current_session.returning_to_primary = 1;
+	current_session.replay_reconciliation = current_session.reconciliations;
+	load_log_merge(&current_session.replay, NUM_SERVERS, current_session.processed_lamport_counters, finish_return_to_primary, NULL);
+}
+
+// called whenever a chunk of the log records is loaded: processes the records until the next chunk is needed
+static void finish_return_to_primary(void *arg)
+{
+	logEvent e;
+	u_int32_t server_id;
+	int result = LOG_MERGE_END;
+	if (current_session.replay_reconciliation != current_session.reconciliations)
 	{
-		min_lc = -1;
-        min_server_id = 0;
-		retrieve_line_from_logs(e, data_available, NUM_SERVERS, current_session.processed_lamport_counters);
-        log_debug("retrieving log lines from files %d %d %d %d %d", data_available[0],data_available[1],data_available[2],data_available[3],data_available[4]);
-		if(!log_line_available(data_available))
-			break;
+		// a server joined while the log was read. records it brought may have to be processed first
+		current_session.returning_to_primary = 0;
+		close_log_merge(&current_session.replay);
+		if (check_primary_conditions())
+			return_to_primary();
+		return;
+	}
+	while (log_remaining(0) && (result = next_merged_log_event(&current_session.replay, &e, &server_id)) == LOG_MERGE_EVENT)
+		process_log_event(e, server_id);
+	if (result == LOG_MERGE_REFILL && log_remaining(0))
+	{
+		refill_log_merge(&current_session.replay, finish_return_to_primary, NULL);
+		return;
+	}
+	current_session.returning_to_primary = 0;
+	close_log_merge(&current_session.replay);
+	if (log_remaining(0))
+	{
+		return_to_primary();	// records were logged while the log was read
+		return;
+	}
+	current_session.state = STATE_PRIMARY;
+	handle_unprocessed_updates();
+}
 
-		for(i = 0;i<NUM_SERVERS;i++)
-		{
-			if(data_available[i])
-			{
-				if(e[i].lamportCounter < min_lc)
-				{
-					min_lc = e[i].lamportCounter;
-					min_server_id = i+1;
-				}
-			}
-		}
-        log_debug("minimum log line is for server %d with lc %d", min_server_id, e[min_server_id-1].lamportCounter);
-		if(min_server_id)
-			process_log_event(e[min_server_id - 1], min_server_id);
+// applies the log records read from <r> (their number, then the server and the record of each), sent by server
+// <sender_id>, in the order they were sent. returns 0 if the records are truncated
+static int apply_server_updates(wireReader *r, u_int32_t sender_id)
+{
+	u_int32_t num_of_records, server_id, i;
+	wireString record;
+	num_of_records = wire_read_u32(r);
+	log_debug("handling %d log records from server %d", num_of_records, sender_id);
+	for (i = 0; i < num_of_records; i++)
+	{
+		server_id = wire_read_u32(r);
+		record = wire_read_string(r);
+		if (!wire_reader_ok(r) || record.length < LOG_RECORD_HEADER_SIZE)
+			break;
+		apply_server_update(sender_id, server_id, record.length, record.data);
 	}
-    return 0;
+	if (i < num_of_records || !wire_reader_ok(r))
+	{
+		log_error("log records from server %d are truncated after %d of %d records", sender_id, i, num_of_records);
+		return 0;
+	}
+	return 1;
+}
+
+// handle a batch of log records from server <sender id>: the records are applied in the order they were sent
+static int handle_server_update_batch(char *message, int size)
+{
+	u_int32_t sender_id;
+	wireReader r;
+	wire_reader_init(&r, message + 1, size - 1);
+	sender_id = wire_read_u32(&r);
+	apply_server_updates(&r, sender_id);
+	return 0;
+}
+
+// a chunk of a resend (see ResendStream): the server whose log is resent, the sequence of the chunk in the resend,
+// then the records as in a TYPE_SERVER_UPDATE_BATCH. our own chunks acknowledge themselves when they come back
+static int handle_resend_chunk(char *message, int size)
+{
+	u_int32_t sender_id, server_id, sequence;
+	wireReader r;
+	wire_reader_init(&r, message + 1, size - 1);
+	sender_id = wire_read_u32(&r);
+	server_id = wire_read_u32(&r);
+	sequence = wire_read_u32(&r);
+	if (apply_server_updates(&r, sender_id) && sender_id == current_session.server_id && server_id >= 1 && server_id <= NUM_SERVERS)
+		resend_chunk_delivered(server_id, sequence);
+	return 0;
+}
+
+// returns 1 if the fields of the log event <e> received from another server can be processed
+static int valid_log_event(const logEvent *e)
+{
+	char username[20], message_text[80];
+	u_int32_t pid, counter, message_length;
+	if (e->chatroom[0] == 0)
+		return 0;
+	if (e->eventType == TYPE_APPEND)
+		return get_append_payload(e, username, message_text, &message_length);
+	if (e->eventType == TYPE_LIKE || e->eventType == TYPE_UNLIKE)
+		return get_like_payload(e, username, &pid, &counter);
+	return 0;
 }
 
-// This function is called if we have received a log update from servers
-static int handle_server_update(char *messsage, int size)
+// applies the log record <record> of server <server_id>, received from server <sender_id>:
+// appends it to our copy of the log of <server_id> and processes it, unless it is a duplicate or malformed
+static int apply_server_update(u_int32_t sender_id, u_int32_t server_id, u_int32_t log_length, const char *record)
 {
-	u_int32_t sender_id, server_id, log_length;
 	logEvent e;
-	memcpy(&sender_id, messsage + 1, 4);
-	memcpy(&server_id, messsage + 5, 4);
-	memcpy(&log_length, messsage + 9, 4);
 	if (server_id == current_session.server_id)
 		return 0;
-	char line[80];
-	memset(line, 0, 80);
-	memcpy(&line, messsage + 13, log_length);
-	log_debug("handling server update (of server %d) from server %d. update line is: %s of length %d", server_id, sender_id, line, log_length);
-	parseLineInLogFile(line, &e);
+	if (server_id < 1 || server_id > NUM_SERVERS || decode_log_record(record, log_length, &e) <= 0 || !valid_log_event(&e))
+	{
+		log_error("invalid log record of length %d (of server %d) from server %d", log_length, server_id, sender_id);
+		return 0;
+	}
+	log_debug("handling server update (of server %d) from server %d. update lc = %d, type = %c, chatroom = %s", server_id, sender_id, e.lamportCounter, e.eventType, e.chatroom);
 	if(e.lamportCounter <= current_session.lamport_counters[current_session.server_id - 1][server_id - 1]){
 		log_debug("received duplicate data. ignoring");
 		return 0;
 	}
-	addEventToLogFile(server_id, line);
+	addEventToLogFile(server_id, &e);
 	if(e.lamportCounter > current_session.lamport_counter)
 		current_session.lamport_counter = e.lamportCounter;
 	current_session.lamport_counters[current_session.server_id - 1][server_id - 1] = e.lamportCounter;
 
 	if(current_session.state == STATE_RECONCILING){
-		if(check_primary_conditions()){
-            log_info("returning to primary state");
-			current_session.state = STATE_PRIMARY;
-			process_log_files(0);	// TODO
-			handle_unprocessed_updates();
-		}
+		if(check_primary_conditions())
+			return_to_primary();
 		return 0;
 	}
 	process_log_event(e, server_id);
 	return 0;
 }
 
+// whether a server in the membership is still missing records of log <server_id> that we have
+static int resend_needed(u_int32_t server_id)
+{
+	int i;
+	for (i = 0; i < NUM_SERVERS; i++)
+		if (current_session.membership[i] && i != current_session.server_id - 1 &&
+			current_session.lamport_counters[i][server_id - 1] < current_session.lamport_counters[current_session.server_id - 1][server_id - 1])
+			return 1;
+	return 0;
+}
+
+static void finish_resend(u_int32_t server_id)
+{
+	ResendStream *stream = &resend_streams[server_id - 1];
+	log_debug("resend of the log of server %d finished at lc %d", server_id, stream->position);
+	stream->active = 0;
+	stream->num_in_flight = 0;
+}
+
+// multicasts the records read for the resend of log <server_id> as one chunk
+static void send_resend_chunk(u_int32_t server_id)
+{
+	ResendStream *stream = &resend_streams[server_id - 1];
+	char record[LOG_RECORD_MAX_SIZE];
+	u_int32_t i, record_length;
+	wireWriter w;
+	wire_writer_init(&w);
+	wire_write_u32(&w, server_id);
+	wire_write_u32(&w, ++stream->sequence);
+	wire_write_u32(&w, stream->chunk.num_of_events);
+	for (i = 0; i < stream->chunk.num_of_events; i++)
+	{
+		record_length = encode_log_record(&stream->chunk.events[i], record);
+		wire_write_u32(&w, server_id);
+		wire_write_string(&w, record, record_length);
+	}
+	stream->position = stream->chunk.events[stream->chunk.num_of_events - 1].lamportCounter;
+	log_debug("resending %d records of server %d up to lc %d", stream->chunk.num_of_events, server_id, stream->position);
+	stream->in_flight[stream->num_in_flight++] = stream->sequence;
+	send_to_servers(TYPE_RESEND_CHUNK, &w);
+}
+
+static void pump_resend(u_int32_t server_id);
+
+// the next chunk of a resend was read from the log
+static void resend_chunk_read(void *arg)
+{
+	ResendStream *stream = (ResendStream *) arg;
+	u_int32_t server_id = stream - resend_streams + 1;
+	stream->reading = 0;
+	if (stream->restarted)
+		stream->restarted = 0;
+	else if (stream->chunk.num_of_events == 0 && stream->num_in_flight == 0)
+		finish_resend(server_id);	// nothing was logged since the last chunk
+	else
+	{
+		stream->end_of_log = stream->chunk.end_of_log;
+		if (stream->chunk.num_of_events)
+			send_resend_chunk(server_id);
+	}
+	free(stream->chunk.events);
+	stream->chunk.events = NULL;
+	pump_resend(server_id);
+}
+
+// keeps the resend of log <server_id> going: reads the next chunk while the window has room, and once the end
+// of the log was reached and every chunk came back, reads on as long as a server is still behind (records logged meanwhile)
+static void pump_resend(u_int32_t server_id)
+{
+	ResendStream *stream = &resend_streams[server_id - 1];
+	if (!stream->active || stream->reading || stream->num_in_flight == RESEND_WINDOW)
+		return;
+	if (stream->end_of_log)
+	{
+		if (stream->num_in_flight > 0)
+			return;
+		if (!resend_needed(server_id))
+		{
+			finish_resend(server_id);
+			return;
+		}
+		stream->end_of_log = 0;
+	}
+	stream->reading = 1;
+	read_log_records(server_id, stream->position, SERVER_UPDATE_BATCH_SIZE, 8, &stream->chunk, resend_chunk_read, stream);
+}
+
 // try to resend missing data to propagate the updates which are not available in other servers
-// it basically tries to find updates newer than LTS <server_id>,<lamport_counter> and resend them
-// for now, we only support 100 most recent updates
-// for the flow control, we will send the data in smaller batches instead
+// it streams the updates newer than LTS <server_id>,<lamport_counter> from the log file (see ResendStream).
+// a resend already under way from an older LTS covers the request
 static int resend_data(u_int32_t server_id, u_int32_t lamport_counter)
 {
-	int i;
-	u_int32_t size = (13 + 1300);
-	char buffer[size];
-	logEvent logs[100]; // TODO: maybe more? / maybe dynamic
-	u_int32_t length = 0;
-	memset(logs, 0, 100*sizeof(logEvent));
-	get_logs_newer_than(server_id, lamport_counter, &length, logs);
-	log_debug("getting newer data than LTS %d,%d from log file, totalling %d", server_id, lamport_counter, length);
-	for(i = 0; i < length; i++)
-	{
-		log_debug("resending log %d, %d of type", server_id, logs[i].lamportCounter, logs[i].eventType);
-		createLogLine(current_session.server_id, logs[i], buffer);
-		send_log_update_to_servers(current_session.server_id, strlen(buffer), buffer);
+	ResendStream *stream = &resend_streams[server_id - 1];
+	if (stream->active)
+	{
+		if (lamport_counter >= stream->position)
+			return 0;
+		if (stream->reading)
+			stream->restarted = 1;
 	}
+	log_debug("resending the log of server %d newer than lc %d", server_id, lamport_counter);
+	stream->position = lamport_counter;
+	stream->end_of_log = 0;
+	if (!stream->active)
+		stream->num_in_flight = 0;
+	stream->active = 1;
+	pump_resend(server_id);
 	return 0;
 }
 
+// chunk <sequence> of the resend of log <server_id> came back: every server in the membership has received it.
+// acknowledge it and send the next chunks. what the other servers have is left to their anti-entropy messages
+static void resend_chunk_delivered(u_int32_t server_id, u_int32_t sequence)
+{
+	ResendStream *stream = &resend_streams[server_id - 1];
+	if (!stream->active || stream->num_in_flight == 0 || stream->in_flight[0] != sequence)
+		return;
+	stream->num_in_flight--;
+	memmove(stream->in_flight, stream->in_flight + 1, stream->num_in_flight * 4);
+	pump_resend(server_id);
+}
+
+// after a membership change the chunks in flight may never come back, so the resends stop waiting for them
+static void reset_resend_windows()
+{
+	u_int32_t i;
+	for (i = 1; i <= NUM_SERVERS; i++)
+	{
+		resend_streams[i - 1].num_in_flight = 0;
+		pump_resend(i);
+	}
+}
+
 // check if we are responsible for the missing data:
 // either if it is our own data, or the server responsible for that data is not present in the partition and we are the lowes numbered server
 static int check_if_we_should_resend_data(u_int32_t server_id)
@@ -1379,18 +2404,24 @@ static int handle_unprocessed_updates()
 static int handle_anti_entropy(char *messsage, int size)
 {
 	u_int32_t sender_id, lamport_ctr;
-	int i, j, offset = 5, outdated = 0, updated = 0;
+	int i, j, outdated = 0, updated = 0;
 	char username[20];
-	memcpy(&sender_id, messsage + 1, 4);
+	wireReader r;
+	wire_reader_init(&r, messsage + 1, size - 1);
+	sender_id = wire_read_u32(&r);
 	if (sender_id == current_session.server_id)
 		return 0;
+	if (wire_remaining(&r) < NUM_SERVERS * NUM_SERVERS * 4)
+	{
+		log_error("invalid anti-entropy message of %d bytes from server %d", size, sender_id);
+		return 0;
+	}
 	log_debug("Parsing Anti-entropy message from %d", sender_id);
 	for (i = 0; i < NUM_SERVERS; i++)	// ROW
 	{
 		for (j = 0; j < NUM_SERVERS; j++)	// COLUMN
 		{
-			memcpy(&lamport_ctr, messsage + offset, 4);
-			offset += 4;
+			lamport_ctr = wire_read_u32(&r);
 			log_debug("anti entropy: lts for row %d col %d is %d", i,j, lamport_ctr);
 			if (i == current_session.server_id - 1)
 			{
@@ -1429,33 +2460,25 @@ static int handle_anti_entropy(char *messsage, int size)
 		send_participant_change_to_servers(current_session.chatrooms[i].name, username, i);
 	}
     log_debug("updated = %d (matrix updated)", updated);
-	if(check_primary_conditions()){
-        log_info("returning to PRIMARY state");
-		current_session.state = STATE_PRIMARY;
-		process_log_files(0);
-		handle_unprocessed_updates();
-	}
+	if(current_session.state == STATE_RECONCILING && check_primary_conditions())
+		return_to_primary();
 	return 0;
 }
 
 // send my lamport counters matrix to all servers
 static int send_anti_entropy_to_server(u_int32_t server_id)
 {
-	u_int32_t size = NUM_SERVERS * NUM_SERVERS * 4;
-	char payload[size];
-	int i, j, offset = 0;
+	wireWriter w;
+	int i, j;
 	log_debug("sending Anti entropy to servers:");
+	wire_writer_init(&w);
 	for (i = 0; i < NUM_SERVERS; i++)
 	{
 		for (j = 0; j < NUM_SERVERS; j++)
-		{
-			memcpy(payload + offset, &current_session.lamport_counters[i][j], 4);
-			offset += 4;
-			
-		}
+			wire_write_u32(&w, current_session.lamport_counters[i][j]);
 		log_debug("Row %d = %d %d %d %d %d", i+1, current_session.lamport_counters[i][0], current_session.lamport_counters[i][1], current_session.lamport_counters[i][2], current_session.lamport_counters[i][3], current_session.lamport_counters[i][4]);
 	}
-	send_to_servers(TYPE_ANTY_ENTROPY, payload, size);
+	send_to_servers(TYPE_ANTY_ENTROPY, &w);
 	return 0;
 }
 
@@ -1465,6 +2488,7 @@ static void handle_server_join(u_int32_t server_id)
     log_debug("handling server join");
 	//current_session.membership[server_id - 1] = 1;
 	current_session.state = STATE_RECONCILING;
+	current_session.reconciliations++;
 	send_anti_entropy_to_server(server_id);
 }
 
@@ -1474,9 +2498,8 @@ static void handle_server_leave(u_int32_t server_id)
 	int i;
 	for (i = 0; i < current_session.num_of_chatrooms; i++)
 	{
-		hash_set_clear(&current_session.chatrooms[i].participants[server_id - 1]);
-		current_session.chatrooms[i].num_of_participants[server_id -1] = 0;
-		send_chatroom_update_to_clients(current_session.chatrooms[i].name, i);
+		if (clear_participants(&current_session.chatrooms[i], server_id - 1))
+			mark_chatroom_dirty(i, CLIENTS_NEED_FULL_UPDATE);
 	}
 	current_session.membership[server_id - 1] = 0;
 }
@@ -1485,10 +2508,9 @@ static void handle_server_leave(u_int32_t server_id)
 // we will update our client data accordingly
 static int handle_client_membership_change(char **target_groups, int num_groups, int is_joined, char *target_member, char *target_group)
 {
-	u_int32_t server_id;
+	u_int32_t server_id, id;
 	char client[20];
-	int ret;
-	int32_t *idx = (int32_t *)malloc(sizeof(int32_t));
+	int32_t idx;
 
 	log_debug("client membership event: target group %s, target_member %s, joined = %d", target_group, target_member, is_joined);
 	sscanf(target_group, "%[^_]_%d", client, &server_id);
@@ -1496,18 +2518,14 @@ static int handle_client_membership_change(char **target_groups, int num_groups,
 	log_debug("client is: %s with size: %d", client, strlen(client));
 	if (!is_joined)
 	{
-		log_debug("map length is %d", hashmap_length(current_session.clients));
-		ret = hashmap_get(current_session.clients, client, (void **)(&idx));
-		if (ret == MAP_OK)
+		log_debug("map length is %d", current_session.clients.size);
+		if (name_map_get(&current_session.clients, client, &idx))
 		{
-			u_int32_t length, count;
 			log_info("My client %s left", client);
-			hashmap_remove(current_session.clients, client);
-			length = current_session.chatrooms[*idx].num_of_participants[current_session.server_id - 1];
-			count = hash_set_remove(&current_session.chatrooms[*idx].participants[current_session.server_id - 1], length, client);
-			current_session.chatrooms[*idx].num_of_participants[current_session.server_id - 1] = count;
-			send_participant_change_to_servers(current_session.chatrooms[*idx].name, client, *idx);
-			send_chatroom_update_to_clients(current_session.chatrooms[*idx].name, *idx);
+			name_map_remove(&current_session.clients, client);
+			if (find_username_id(client, &id) && remove_participant(&current_session.chatrooms[idx], current_session.server_id - 1, id))
+				queue_participant_delta(idx, id, 0);
+			send_participant_change_to_servers(current_session.chatrooms[idx].name, client, idx);
 		}
 	}
 	return 0;
@@ -1515,54 +2533,79 @@ static int handle_client_membership_change(char **target_groups, int num_groups,
 
 // we received a participant update message from other servers,
 // this message contains the list of participants that server has from all 5 servers (this helps path propagation)
-// we will update our participant data with the data from that server and every server that is not in current membership
+// we will update our participant data with the data from that server and every server that is not in current membership.
+// all five lists are checked before any of them is applied, so a truncated message changes nothing
 static int handle_participant_update(char *message, int msg_size)
 {
 	u_int32_t server_id, num_of_participants;
-	u_int32_t chatroom_length, offset, uname_length;
-
 	int chatroom_index, i, p, flag = 1;
 	char username[20], chatroom[20];
-	memcpy(&server_id, message + 1, 4);
-	memcpy(&chatroom_length, message + 5, 4);
-	memcpy(&chatroom, message + 9, chatroom_length);
-	chatroom[chatroom_length] = 0;
+	idSet incoming, leaving;
+	u_int32_t position, id;
+	Chatroom *c;
+	wireReader r, lists;
+	wire_reader_init(&r, message + 1, msg_size - 1);
+	server_id = wire_read_u32(&r);
+	if (!wire_string_copy(wire_read_string(&r), chatroom, sizeof(chatroom)))
+	{
+		log_error("invalid participant update from server %d", server_id);
+		return 0;
+	}
 	if (server_id == current_session.server_id)
 		return 0;
+	lists = r;
+	for (i = 0; i < 5; i++)
+	{
+		num_of_participants = wire_read_u32(&r);
+		for (p = 0; p < num_of_participants && wire_reader_ok(&r); p++)
+			if (!wire_string_copy(wire_read_string(&r), username, sizeof(username)))
+				break;
+		if (p < num_of_participants || !wire_reader_ok(&r))
+		{
+			// a truncated list would drop the missing participants
+			log_error("participant update from server %d is truncated", server_id);
+			return 0;
+		}
+	}
 	chatroom_index = find_chatroom_index(chatroom);
 	if (chatroom_index == -1)
 	{
 		// I don't have the chatroom. Let's create it:
 		chatroom_index = create_new_chatroom(chatroom, 0);
 	}
-	offset = 9 + chatroom_length;
+	c = &current_session.chatrooms[chatroom_index];
+	r = lists;
 	for (i = 0; i < 5; i++)
 	{
-		if (i != server_id - 1 && current_session.membership[i])
-			flag = 0;
-		else
-		{
-			flag = 1;
-			hash_set_clear(&current_session.chatrooms[chatroom_index].participants[i]);
-			current_session.chatrooms[chatroom_index].num_of_participants[i] = 0;
-		}
-		memcpy(&num_of_participants, message + offset, 4);
+		flag = i == server_id - 1 || !current_session.membership[i];
+		id_set_init(&incoming);
+		num_of_participants = wire_read_u32(&r);
 		log_debug("num of participants %d is %d", i + 1, num_of_participants);
-		offset += 4;
 		for (p = 0; p < num_of_participants; p++)
 		{
-			memcpy(&uname_length, message + offset, 4);
-			memcpy(username, message + offset + 4, uname_length);
-			username[uname_length] = 0;
+			wire_string_copy(wire_read_string(&r), username, sizeof(username));
 			log_debug("parsing user name %s for server %d list of p, will be added? %d", username, i + 1, flag);
-			offset += (4 + uname_length);
 			if (flag)
-			{
-				hash_set_insert(&current_session.chatrooms[chatroom_index].participants[i], username, strlen(username));
-				current_session.chatrooms[chatroom_index].num_of_participants[i]++;
-			}
+				id_set_insert(&incoming, intern_username(username));
 		}
+		if (!flag)
+			continue;
+		// only the participants that changed are sent to clients
+		id_set_init(&leaving);
+		position = 0;
+		while (id_set_next(&c->participants[i], &position, &id))
+			if (!id_set_contains(&incoming, id))
+				id_set_insert(&leaving, id);
+		position = 0;
+		while (id_set_next(&leaving, &position, &id))
+			if (remove_participant(c, i, id))
+				queue_participant_delta(chatroom_index, id, 0);
+		position = 0;
+		while (id_set_next(&incoming, &position, &id))
+			if (add_participant(c, i, id))
+				queue_participant_delta(chatroom_index, id, 1);
+		id_set_clear(&leaving);
+		id_set_clear(&incoming);
 	}
-	send_chatroom_update_to_clients(chatroom, chatroom_index);
 	return 0;
 }
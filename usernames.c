@@ -0,0 +1,232 @@
+#include "usernames.h"
+#include "nameMap.h"
+
+#include <assert.h>
+
+static nameMap username_ids;                            // username -> id
+static char (*usernames)[USERNAME_MAX_LENGTH] = NULL;   // id -> username
+static u_int32_t num_of_usernames = 0;
+static u_int32_t usernames_capacity = 0;
+
+// returns the id of <username>, assigning the next free id if it was not seen before
+u_int32_t intern_username(const char *username)
+{
+    u_int32_t id;
+    if(find_username_id(username, &id))
+        return id;
+    if(num_of_usernames == usernames_capacity)
+    {
+        usernames_capacity = usernames_capacity ? usernames_capacity * 2 : 256;
+        usernames = realloc(usernames, usernames_capacity * USERNAME_MAX_LENGTH);
+        assert(usernames);
+    }
+    id = num_of_usernames++;
+    memset(usernames[id], 0, USERNAME_MAX_LENGTH);
+    strncpy(usernames[id], username, USERNAME_MAX_LENGTH - 1);
+    name_map_put(&username_ids, usernames[id], id);
+    log_debug("username %s interned as %u", usernames[id], id);
+    return id;
+}
+
+// looks <username> up without adding it. returns 1 and sets <id> if it is known
+int find_username_id(const char *username, u_int32_t *id)
+{
+    int32_t index;
+    if(!name_map_get(&username_ids, username, &index))
+        return 0;
+    *id = index;
+    return 1;
+}
+
+const char *get_username(u_int32_t id)
+{
+    if(id >= num_of_usernames)
+        return NULL;
+    return usernames[id];
+}
+
+///////////////////////////////// id sets ///////////////////////////////////////////
+
+void id_set_init(idSet *set)
+{
+    memset(set, 0, sizeof(idSet));
+}
+
+// binary search in array mode. returns 1 if <id> is at <pos>, otherwise <pos> is where it would be inserted
+static int id_set_find(const idSet *set, u_int32_t id, u_int32_t *pos)
+{
+    u_int32_t low = 0, high = set->count, mid;
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        if(set->words[mid] == id)
+        {
+            *pos = mid;
+            return 1;
+        }
+        if(set->words[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *pos = low;
+    return 0;
+}
+
+// switches an array set to a bitmap of <words> words starting at word <base>
+static void id_set_to_bitmap(idSet *set, u_int32_t base, u_int32_t words)
+{
+    u_int32_t i, *bits = calloc(words, 4);
+    assert(bits);
+    for(i = 0; i < set->count; i++)
+        bits[set->words[i] / 32 - base] |= 1u << (set->words[i] % 32);
+    free(set->words);
+    set->words = bits;
+    set->capacity = words;
+    set->base = base;
+    set->bitmap = 1;
+}
+
+// switches a bitmap set back to a sorted array
+static void id_set_to_array(idSet *set)
+{
+    u_int32_t position = 0, id, i = 0, capacity = 4, *ids;
+    while(capacity < set->count)
+        capacity *= 2;
+    ids = malloc(capacity * 4);
+    assert(ids);
+    while(id_set_next(set, &position, &id))
+        ids[i++] = id;
+    free(set->words);
+    set->words = ids;
+    set->capacity = capacity;
+    set->base = 0;
+    set->bitmap = 0;
+}
+
+// grows a bitmap set so that word <word> is covered
+static void id_set_grow_bitmap(idSet *set, u_int32_t word)
+{
+    u_int32_t front = 0, words = set->capacity, *bits;
+    if(word < set->base)
+    {
+        // grow downwards by at least the current size (as far as word 0) so that repeated
+        // inserts of smaller ids do not copy the bitmap every time
+        front = set->base - word;
+        if(front < set->capacity)
+            front = set->capacity < set->base ? set->capacity : set->base;
+        words += front;
+    }
+    else
+        words = set->capacity * 2 > word - set->base + 1 ? set->capacity * 2 : word - set->base + 1;
+    bits = calloc(words, 4);
+    assert(bits);
+    memcpy(bits + front, set->words, set->capacity * 4);
+    free(set->words);
+    set->words = bits;
+    set->capacity = words;
+    set->base -= front;
+}
+
+// returns 1 if <id> was added, 0 if it was already in the set
+int id_set_insert(idSet *set, u_int32_t id)
+{
+    u_int32_t pos, smallest, largest;
+    if(!set->bitmap)
+    {
+        if(id_set_find(set, id, &pos))
+            return 0;
+        if(set->count == set->capacity)
+        {
+            smallest = set->count && set->words[0] < id ? set->words[0] : id;
+            largest = set->count && set->words[set->count - 1] > id ? set->words[set->count - 1] : id;
+            if(set->count + 1 >= ID_SET_BITMAP_MIN && largest / 32 - smallest / 32 + 1 <= set->count + 1)
+            {
+                id_set_to_bitmap(set, smallest / 32, largest / 32 - smallest / 32 + 1);
+                return id_set_insert(set, id);
+            }
+            set->capacity = set->capacity ? set->capacity * 2 : 4;
+            set->words = realloc(set->words, set->capacity * 4);
+            assert(set->words);
+        }
+        memmove(set->words + pos + 1, set->words + pos, (set->count - pos) * 4);
+        set->words[pos] = id;
+        set->count++;
+        return 1;
+    }
+    if(id / 32 < set->base || id / 32 - set->base >= set->capacity)
+        id_set_grow_bitmap(set, id / 32);
+    if(set->words[id / 32 - set->base] & (1u << (id % 32)))
+        return 0;
+    set->words[id / 32 - set->base] |= 1u << (id % 32);
+    set->count++;
+    return 1;
+}
+
+// returns 1 if <id> was removed, 0 if it was not in the set
+int id_set_remove(idSet *set, u_int32_t id)
+{
+    u_int32_t pos;
+    if(!id_set_contains(set, id))
+        return 0;
+    if(set->bitmap)
+    {
+        set->words[id / 32 - set->base] &= ~(1u << (id % 32));
+        set->count--;
+        // a bitmap that is mostly empty is bigger and slower to iterate than the array
+        if(set->count < ID_SET_ARRAY_MAX || set->capacity > 4 * set->count)
+            id_set_to_array(set);
+        return 1;
+    }
+    id_set_find(set, id, &pos);
+    memmove(set->words + pos, set->words + pos + 1, (set->count - pos - 1) * 4);
+    set->count--;
+    return 1;
+}
+
+int id_set_contains(const idSet *set, u_int32_t id)
+{
+    u_int32_t pos;
+    if(set->bitmap)
+        return id / 32 >= set->base && id / 32 - set->base < set->capacity &&
+            (set->words[id / 32 - set->base] & (1u << (id % 32))) != 0;
+    return id_set_find(set, id, &pos);
+}
+
+// iterates the set in ascending order. <position> starts at 0 and is advanced by each call.
+// returns 1 and sets <id>, or 0 when there are no more ids
+int id_set_next(const idSet *set, u_int32_t *position, u_int32_t *id)
+{
+    u_int32_t word, bits;
+    if(!set->bitmap)
+    {
+        if(*position >= set->count)
+            return 0;
+        *id = set->words[(*position)++];
+        return 1;
+    }
+    // in bitmap mode <position> is the next id to look at
+    if(*position < set->base * 32)
+        *position = set->base * 32;
+    while(*position / 32 - set->base < set->capacity)
+    {
+        word = *position / 32 - set->base;
+        bits = set->words[word] >> (*position % 32);
+        if(bits == 0)
+        {
+            *position = (set->base + word + 1) * 32;
+            continue;
+        }
+        *position += __builtin_ctz(bits);
+        *id = (*position)++;
+        return 1;
+    }
+    return 0;
+}
+
+// removes all ids and releases the memory of the set
+void id_set_clear(idSet *set)
+{
+    free(set->words);
+    id_set_init(set);
+}
@@ -0,0 +1,45 @@
+#ifndef USERNAMES_H
+#define USERNAMES_H
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+//	Username interning and sets of username ids.
+//
+////////////////////////////////////////////////////////////////////////////////////
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+#define USERNAME_MAX_LENGTH 20			// including the terminating 0, same as Message.userName
+#define ID_SET_BITMAP_MIN 32			// a set is not considered for the bitmap layout below this many ids
+#define ID_SET_ARRAY_MAX 16				// a bitmap set goes back to the sorted array below this many ids
+
+// Every username seen by the server gets a dense id (0, 1, 2, ...) that stays valid for the
+// lifetime of the process. The table is only used from the event loop thread.
+// The name returned by get_username is only valid until the next username is interned.
+u_int32_t intern_username(const char *username);
+int find_username_id(const char *username, u_int32_t *id);
+const char *get_username(u_int32_t id);
+
+// A set of username ids. Small sets are a sorted array of ids; once a set is dense enough that
+// a bitmap over [smallest id, largest id] is not bigger than the array, it switches to the bitmap.
+// It goes back to the array when removals leave the bitmap mostly empty.
+// Both layouts iterate in ascending id order.
+typedef struct {
+	u_int32_t *words;		// sorted ids, or bit i of words[i / 32 - base] set for each id i in bitmap mode
+	u_int32_t count;		// number of ids in the set
+	u_int32_t capacity;		// allocated words
+	u_int32_t bitmap;		// 1 if <words> is a bitmap
+	u_int32_t base;			// in bitmap mode, the word of ids covered by words[0]
+} idSet;
+
+void id_set_init(idSet *set);
+int id_set_insert(idSet *set, u_int32_t id);
+int id_set_remove(idSet *set, u_int32_t id);
+int id_set_contains(const idSet *set, u_int32_t id);
+int id_set_next(const idSet *set, u_int32_t *position, u_int32_t *id);
+void id_set_clear(idSet *set);
+
+#endif
@@ -0,0 +1,208 @@
+#include "wireCodec.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *pool[WIRE_POOL_SIZE];
+static u_int32_t pool_size = 0;
+
+///////////////////////////////// reader ////////////////////////////////////////////
+
+void wire_reader_init(wireReader *r, const char *data, u_int32_t size)
+{
+    r->data = data;
+    r->size = size;
+    r->offset = 0;
+    r->failed = 0;
+}
+
+// returns the next <length> bytes and moves past them, or NULL (failing the reader) if the message is shorter
+const char *wire_read_bytes(wireReader *r, u_int32_t length)
+{
+    const char *bytes;
+    if(r->failed || length > r->size - r->offset)
+    {
+        r->failed = 1;
+        return NULL;
+    }
+    bytes = r->data + r->offset;
+    r->offset += length;
+    return bytes;
+}
+
+u_int8_t wire_read_u8(wireReader *r)
+{
+    const char *bytes = wire_read_bytes(r, 1);
+    return bytes ? (u_int8_t)bytes[0] : 0;
+}
+
+u_int32_t wire_read_u32(wireReader *r)
+{
+    u_int32_t value = 0;
+    const char *bytes = wire_read_bytes(r, 4);
+    if(bytes)
+        memcpy(&value, bytes, 4);
+    return value;
+}
+
+wireString wire_read_string(wireReader *r)
+{
+    wireString s;
+    s.length = wire_read_u32(r);
+    s.data = wire_read_bytes(r, s.length);
+    if(s.data == NULL)
+        s.length = 0;
+    return s;
+}
+
+u_int32_t wire_remaining(const wireReader *r)
+{
+    return r->failed ? 0 : r->size - r->offset;
+}
+
+int wire_reader_ok(const wireReader *r)
+{
+    return !r->failed;
+}
+
+// copies <s> into <buffer> and terminates it. returns 0 (leaving <buffer> empty) if it needs more than <capacity> bytes
+int wire_string_copy(wireString s, char *buffer, u_int32_t capacity)
+{
+    if(s.length >= capacity)
+    {
+        buffer[0] = 0;
+        return 0;
+    }
+    memcpy(buffer, s.data, s.length);
+    buffer[s.length] = 0;
+    return 1;
+}
+
+///////////////////////////////// writer ////////////////////////////////////////////
+
+void wire_writer_init(wireWriter *w)
+{
+    if(pool_size > 0)
+        w->buffer = pool[--pool_size];
+    else
+    {
+        w->buffer = malloc(WIRE_BUFFER_SIZE);
+        assert(w->buffer);
+    }
+    w->capacity = WIRE_BUFFER_SIZE;
+    w->start = WIRE_HEADROOM;
+    w->end = WIRE_HEADROOM;
+    w->pooled = 1;
+    w->failed = 0;
+}
+
+// writes into <buffer> of the caller instead of a send buffer
+void wire_writer_init_buffer(wireWriter *w, char *buffer, u_int32_t capacity)
+{
+    w->buffer = buffer;
+    w->capacity = capacity;
+    w->start = 0;
+    w->end = 0;
+    w->pooled = 0;
+    w->failed = 0;
+}
+
+// returns room for <length> bytes at the end of the message, to be filled in by the caller,
+// or NULL (failing the writer) if the buffer is full
+char *wire_reserve(wireWriter *w, u_int32_t length)
+{
+    char *bytes;
+    if(w->failed || length > w->capacity - w->end)
+    {
+        if(!w->failed)
+            log_error("message does not fit in %d bytes", w->capacity - w->start);
+        w->failed = 1;
+        return NULL;
+    }
+    bytes = w->buffer + w->end;
+    w->end += length;
+    return bytes;
+}
+
+void wire_write_bytes(wireWriter *w, const void *data, u_int32_t length)
+{
+    char *bytes = wire_reserve(w, length);
+    if(bytes)
+        memcpy(bytes, data, length);
+}
+
+void wire_write_u8(wireWriter *w, u_int8_t value)
+{
+    wire_write_bytes(w, &value, 1);
+}
+
+void wire_write_u32(wireWriter *w, u_int32_t value)
+{
+    wire_write_bytes(w, &value, 4);
+}
+
+void wire_write_string(wireWriter *w, const char *data, u_int32_t length)
+{
+    wire_write_u32(w, length);
+    wire_write_bytes(w, data, length);
+}
+
+// writes <length> bytes in front of the message
+static void wire_prepend_bytes(wireWriter *w, const void *data, u_int32_t length)
+{
+    if(w->failed || length > w->start)
+    {
+        if(!w->failed)
+            log_error("message header does not fit in the headroom");
+        w->failed = 1;
+        return;
+    }
+    w->start -= length;
+    memcpy(w->buffer + w->start, data, length);
+}
+
+void wire_prepend_u8(wireWriter *w, u_int8_t value)
+{
+    wire_prepend_bytes(w, &value, 1);
+}
+
+void wire_prepend_u32(wireWriter *w, u_int32_t value)
+{
+    wire_prepend_bytes(w, &value, 4);
+}
+
+// headers are prepended last field first, so the length goes in front of the bytes
+void wire_prepend_string(wireWriter *w, const char *data, u_int32_t length)
+{
+    wire_prepend_bytes(w, data, length);
+    wire_prepend_u32(w, length);
+}
+
+const char *wire_message(const wireWriter *w)
+{
+    return w->buffer + w->start;
+}
+
+u_int32_t wire_size(const wireWriter *w)
+{
+    return w->end - w->start;
+}
+
+int wire_writer_ok(const wireWriter *w)
+{
+    return !w->failed;
+}
+
+// returns the send buffer to the pool
+void wire_writer_release(wireWriter *w)
+{
+    if(!w->pooled)
+        return;
+    if(pool_size < WIRE_POOL_SIZE)
+        pool[pool_size++] = w->buffer;
+    else
+        free(w->buffer);
+    w->buffer = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef WIRE_CODEC_H
+#define WIRE_CODEC_H
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+//	Reading and writing the messages exchanged by clients and servers.
+//
+////////////////////////////////////////////////////////////////////////////////////
+
+#include <sys/types.h>
+
+#define WIRE_BUFFER_SIZE 102400			// largest message, same as MAX_MESSLEN
+#define WIRE_HEADROOM 32				// bytes kept free in front of a written message for its header
+#define WIRE_POOL_SIZE 8				// send buffers kept for reuse
+
+// Integers are in host order and strings are a 4-byte length followed by the bytes (not terminated).
+//
+// A reader walks a received message. Every read is bounds checked: once a read runs past the end the reader
+// is marked failed and the reads that follow return zeros and empty views, so a handler can read all the
+// fields of a message and check wire_reader_ok() once at the end.
+// Strings and byte runs are returned as views into the received message, nothing is copied.
+typedef struct {
+	const char *data;					// not terminated
+	u_int32_t length;
+} wireString;
+
+typedef struct {
+	const char *data;
+	u_int32_t size;
+	u_int32_t offset;					// next byte to read
+	int failed;							// 1 once a read ran past the end of the message
+} wireReader;
+
+void wire_reader_init(wireReader *r, const char *data, u_int32_t size);
+u_int8_t wire_read_u8(wireReader *r);
+u_int32_t wire_read_u32(wireReader *r);
+wireString wire_read_string(wireReader *r);
+const char *wire_read_bytes(wireReader *r, u_int32_t length);
+u_int32_t wire_remaining(const wireReader *r);
+int wire_reader_ok(const wireReader *r);
+int wire_string_copy(wireString s, char *buffer, u_int32_t capacity);
+
+// A writer builds a message in a send buffer taken from a pool. The body is written first; WIRE_HEADROOM bytes
+// are left in front of it so the header (type, sender) can be prepended afterwards without moving the body.
+// A writer can also fill a buffer of the caller (without headroom), for parts of messages that are kept around.
+// A write that does not fit marks the writer failed and is dropped.
+// The pool is not locked: writers are only used from the event loop thread.
+typedef struct {
+	char *buffer;
+	u_int32_t capacity;					// bytes of <buffer>
+	u_int32_t start;					// first byte of the message (moves back as headers are prepended)
+	u_int32_t end;						// end of the message
+	int pooled;							// 1 if <buffer> belongs to the pool
+	int failed;							// 1 once a write did not fit
+} wireWriter;
+
+void wire_writer_init(wireWriter *w);
+void wire_writer_init_buffer(wireWriter *w, char *buffer, u_int32_t capacity);
+void wire_write_u8(wireWriter *w, u_int8_t value);
+void wire_write_u32(wireWriter *w, u_int32_t value);
+void wire_write_bytes(wireWriter *w, const void *data, u_int32_t length);
+void wire_write_string(wireWriter *w, const char *data, u_int32_t length);
+char *wire_reserve(wireWriter *w, u_int32_t length);
+void wire_prepend_u8(wireWriter *w, u_int8_t value);
+void wire_prepend_u32(wireWriter *w, u_int32_t value);
+void wire_prepend_string(wireWriter *w, const char *data, u_int32_t length);
+const char *wire_message(const wireWriter *w);
+u_int32_t wire_size(const wireWriter *w);
+int wire_writer_ok(const wireWriter *w);
+void wire_writer_release(wireWriter *w);
+
+#endif